@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+# Compares throughput and predictive performance of Online PLT trained with
+# locked and lock-free (hogwild) updates of base classifiers for different numbers of threads.
+# Usage: bash oplt_hogwild.sh [dataset ...]
+
+EXP_DIR=$( dirname "${BASH_SOURCE[0]}" )
+
+MODEL=models_oplt_hogwild
+RESULTS=results_oplt_hogwild
+
+DATASETS=("$@")
+if [[ ${#DATASETS[@]} -eq 0 ]]; then
+    DATASETS=(eurlex amazonCat wiki10)
+fi
+
+THREADS=(1 2 4 8 16 32)
+HOGWILD=(0 1)
+
+for d in "${DATASETS[@]}"; do
+    for t in "${THREADS[@]}"; do
+        for h in "${HOGWILD[@]}"; do
+            TRAIN_ARGS="-m oplt --optimizer adagrad --loss log --treeType onlineBestScore --onlineTreeAlpha 0.75 --hash 262144 --seed 2020 --hogwild ${h} -t ${t}"
+            TEST_ARGS="--topK 5"
+            bash ${EXP_DIR}/test.sh $d "${TRAIN_ARGS}" "${TEST_ARGS}" $MODEL $RESULTS
+        done
+    done
+done
+
+# Summary: train time and precision@k for each configuration
+for f in ${RESULTS}/*; do
+    echo "$(basename $f): $(grep -E 'Train real time \(s\)' $f | grep -oE '[0-9\.]+$') s, $(grep -E '^P@1:|^P@5:' $f | tr -d ' \n')"
+done
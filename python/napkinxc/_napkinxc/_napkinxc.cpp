@@ -162,10 +162,12 @@ public:
             args.input = path;
             SRMatrix labels;
             SRMatrix features;
-            DataReader dataReader(args);
-            dataReader.readData(labels, features, args);
+            if(!args.streamTrain) {
+                DataReader dataReader(args);
+                dataReader.readData(labels, features, args);
+            }
             
-            fitHelper(labels, features);
+            fitHelper(labels, features, args.streamTrain);
         }
     }
 
@@ -189,7 +191,15 @@ public:
         if(!model->isPreloaded()) model->preload(args, args.output);
     }
 
+    // While the model is being fitted in another thread, it is not (re)loaded,
+    // prediction goes to the model being trained, which uses its snapshot (only oplt)
     void load(){
+        std::lock_guard<std::mutex> lock(modelMtx);
+        if(fitting){
+            if(model == nullptr || !model->isTraining())
+                throw std::invalid_argument("Model is being fitted, prediction during fitting is supported only by oplt model after its training starts");
+            return;
+        }
         if(model == nullptr){
             args.loadFromFile(joinPath(args.output, "args.bin"));
             model = Model::factory(args);
@@ -202,11 +212,13 @@ public:
     }
 
     void setThresholds(std::vector<Real> thresholds){
+        if(fitting) throw std::invalid_argument("Thresholds cannot be set while the model is being fitted");
         load();
         model->setThresholds(thresholds);
     }
 
     void setLabelsWeights(std::vector<Real> weights){
+        if(fitting) throw std::invalid_argument("Labels weights cannot be set while the model is being fitted");
         load();
         model->setLabelsWeights(weights);
     }
@@ -230,6 +242,24 @@ public:
         return pred;
     }
 
+    std::vector<std::vector<Real>> predictProbaForLabels(py::object inputFeatures, int featuresDataType, std::vector<std::vector<int>> labels){
+        std::vector<std::vector<Real>> pred;
+        SRMatrix features;
+        readSRMatrix(features, inputFeatures, (InputDataType)featuresDataType, true);
+        if(features.rows() != labels.size())
+            throw py::value_error("Number of rows in labels must be equal to the number of data points.");
+        {
+            py::gil_scoped_release release;
+
+            load();
+            pred.reserve(features.rows());
+            for(int r = 0; r < features.rows(); ++r)
+                pred.push_back(model->predictForLabels(labels[r], features[r], args));
+        }
+
+        return pred;
+    }
+
     std::vector<std::vector<int>> predictForFile(std::string path, int topK, Real threshold) {
         auto predWithProba = predictProbaForFile(path, topK, threshold);
         return dropProbaHelper(predWithProba);
@@ -240,12 +270,13 @@ public:
         {
             py::gil_scoped_release release;
 
-            args.input = path;
+            Args readArgs = args; // Input of the model being fitted is not changed
+            readArgs.input = path;
             SRMatrix labels;
             SRMatrix features;
-            DataReader dataReader(args);
-            dataReader.readData(labels, features, args);
-            
+            DataReader dataReader(readArgs);
+            dataReader.readData(labels, features, readArgs);
+
             load();
             pred = predictHelper(features, topK, threshold);
         }
@@ -274,11 +305,12 @@ public:
         {
             py::gil_scoped_release release;
 
-            args.input = path;
+            Args readArgs = args; // Input of the model being fitted is not changed
+            readArgs.input = path;
             SRMatrix labels;
             SRMatrix features;
-            DataReader dataReader(args);
-            dataReader.readData(labels, features, args);
+            DataReader dataReader(readArgs);
+            dataReader.readData(labels, features, readArgs);
 
             load();
             results = testHelper(labels, features, topK, threshold, metricsStr);
@@ -375,6 +407,8 @@ public:
 private:
     Args args;
     std::shared_ptr<Model> model;
+    std::mutex modelMtx; // Guards creation and loading of the model
+    std::atomic<bool> fitting{false};
     
     template<typename T> bool isArrayType(py::array& pyArray){
         return py::isinstance<py::array_t<T>>(pyArray);
@@ -495,38 +529,50 @@ private:
             throw py::value_error("Unsupported data type.");
     }
 
-    inline void fitHelper(SRMatrix& labels, SRMatrix& features){
+    inline void fitHelper(SRMatrix& labels, SRMatrix& features, bool onStream = false){
         // Save args to file
         args.printArgs("train");
         makeDir(args.output);
         args.saveToFile(joinPath(args.output, "args.bin"));
 
         // Create and train model (train function also saves model)
-        if(model == nullptr) model = Model::factory(args);
-        model->train(labels, features, args, args.output);
+        {
+            std::lock_guard<std::mutex> lock(modelMtx);
+            if(model == nullptr) model = Model::factory(args);
+            fitting = true;
+        }
+        try {
+            if(onStream) model->trainOnStream(args, args.output);
+            else model->train(labels, features, args, args.output);
+        } catch (...) {
+            fitting = false;
+            throw;
+        }
+        fitting = false;
     }
 
     inline std::vector<std::vector<std::pair<int, Real>>> predictHelper(SRMatrix& features, int topK, Real threshold){
-        args.printArgs("predict");
-
-        // TODO: refactor this
-        args.topK = topK;
-        args.threshold = threshold;
-        auto predictions = model->predictBatch(features, args);
+        // Copy, so prediction during fitting does not change args used by training
+        Args predictArgs = args;
+        predictArgs.printArgs("predict");
+        predictArgs.topK = topK;
+        predictArgs.threshold = threshold;
+        auto predictions = model->predictBatch(features, predictArgs);
 
         // This is only safe because it's struct with two fields casted to pair, don't do this with tuples!
         return reinterpret_cast<std::vector<std::vector<std::pair<int, Real>>>&>(predictions);
     }
 
     inline std::vector<std::pair<std::string, Real>> testHelper(SRMatrix& labels, SRMatrix& features, int topK, Real threshold, std::string metricsStr){
-        args.printArgs("test");
+        Args testArgs = args; // Copy, so testing during fitting does not change args used by training
+        testArgs.printArgs("test");
 
-        args.topK = topK;
-        args.threshold = threshold;
-        auto predictions = model->predictBatch(features, args);
+        testArgs.topK = topK;
+        testArgs.threshold = threshold;
+        auto predictions = model->predictBatch(features, testArgs);
 
-        args.metrics = metricsStr;
-        auto metrics = Metric::factory(args, model->outputSize());
+        testArgs.metrics = metricsStr;
+        auto metrics = Metric::factory(testArgs, model->outputSize());
         for (auto& m : metrics) m->accumulate(labels, predictions);
 
         std::vector<std::pair<std::string, Real>> results;
@@ -573,6 +619,7 @@ PYBIND11_MODULE(_napkinxc, n) {
     .def("set_labels_weights", &CPPModel::setLabelsWeights)
     .def("predict", &CPPModel::predict, OE_CALL_GUARDS)
     .def("predict_proba", &CPPModel::predictProba, OE_CALL_GUARDS)
+    .def("predict_proba_for_labels", &CPPModel::predictProbaForLabels, OE_CALL_GUARDS)
     .def("predict_for_file", &CPPModel::predictForFile, OE_CALL_GUARDS)
     .def("predict_proba_for_file", &CPPModel::predictProbaForFile, OE_CALL_GUARDS)
     .def("test", &CPPModel::test, OE_CALL_GUARDS)
@@ -69,6 +69,8 @@ class Model():
     def predict(self, X, top_k=0, threshold=0, labels_weights=None):
         """
         Predict labels for data points in X.
+        Online PLT (oplt) model can be used for prediction while it is fitted in another thread,
+        then the latest snapshot of the model is used (see snapshot_interval argument).
 
         :param X: Data points as a matrix or list of lists of int or tuples of int and float (feature id, value).
         :type X: csr_matrix, ndarray, list[list[int]|tuple[int]], list[list[tuple[int, float]]
@@ -108,6 +110,20 @@ class Model():
         threshold = self._prepare_pred(top_k, threshold, labels_weights)
         return self._model.predict_proba(X, Model._check_data_type(X), top_k, threshold)
 
+    def predict_proba_for_labels(self, X, labels):
+        """
+        Calculate probability estimates of the given labels for data points in X.
+        Labels of a single data point are scored together, so tree-based models compute shared parts of their paths once.
+
+        :param X: Data points as a matrix or list of lists of int or tuples of int and float (feature id, value).
+        :type X: csr_matrix, ndarray, list[list[int]|tuple[int]], list[list[tuple[int, float]]
+        :param labels: List of lists of label ids to score, one list for each data point
+        :type labels: list[list[int]]
+        :return: List of lists with probability estimates in the same order as labels
+        :rtype: list[list[float]]
+        """
+        return self._model.predict_proba_for_labels(X, Model._check_data_type(X), labels)
+
     def predict_for_file(self, path, top_k=0, threshold=0, labels_weights=None):
         """
         Predict labels for data points in the given file in multi-label svmlight/libsvm format.
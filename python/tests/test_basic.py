@@ -59,3 +59,33 @@ def test_br_train_test():
 
 def test_ovr_train_test():
     _test_model(OVR, {"pick_one_label_weighting": True})
+
+
+def _test_predict_proba_for_labels(model_class, model_config):
+    X_train, Y_train = load_dataset(TEST_DATASET, "train", root=TEST_DATA_PATH)
+    X_test, Y_test = load_dataset(TEST_DATASET, "test", root=TEST_DATA_PATH)
+
+    model = model_class(MODEL_PATH, seed=TEST_SEED, **model_config)
+    model.fit(X_train, Y_train)
+
+    # Scores of the top labels have to be the same as the ones returned with them by predict_proba
+    Y_pred_proba = model.predict_proba(X_test, top_k=3)
+    labels = [[l for l, _ in y] for y in Y_pred_proba]
+    Y_labels_proba = model.predict_proba_for_labels(X_test, labels)
+
+    for y_pred, y_labels in zip(Y_pred_proba, Y_labels_proba):
+        assert np.allclose([p for _, p in y_pred], y_labels, atol=1e-5)
+
+    shutil.rmtree(MODEL_PATH, ignore_errors=True)
+
+
+def test_plt_predict_proba_for_labels():
+    _test_predict_proba_for_labels(PLT, {})
+
+
+def test_hsm_predict_proba_for_labels():
+    _test_predict_proba_for_labels(HSM, {"pick_one_label_weighting": True})
+
+
+def test_plt_ensemble_predict_proba_for_labels():
+    _test_predict_proba_for_labels(PLT, {"ensemble": 3})
@@ -40,6 +40,7 @@ Args::Args() {
     seed = time(nullptr);
     rngSeeder.seed(seed);
     threads = getCpuCount();
+    numa = false;
     memLimit = getSystemMemory();
     saveGrads = false;
     resume = false;
@@ -78,6 +79,7 @@ Args::Args() {
     // Ensemble options
     ensemble = 0;
     ensOnTheTrot = true;
+    ensParallel = 1;
     ensMissingScores = true;
 
     // For online training
@@ -85,7 +87,14 @@ Args::Args() {
     epochs = 1;
     tmax = -1;
     l2Penalty = 0;
+    l1Penalty = 0;
     adagradEps = 0.001;
+    streamTrain = false;
+    streamCache = false;
+    hogwild = false;
+    miniBatch = 1;
+    snapshotInterval = 0;
+    checkpointInterval = 0;
 
     // Tree options
     treeStructure = "";
@@ -105,10 +114,13 @@ Args::Args() {
 
     // extremeText options
     dims = 100;
+    quantize = false;
+    quantizeOutput = false;
 
     // MACH options
     machHashes = 10;
     machBuckets = 100;
+    machTopBuckets = 5;
 
     // Prediction options
     topK = 5;
@@ -121,6 +133,8 @@ Args::Args() {
     beamSearchWidth = 10;
     beamSearchUnpack = true;
     batchRows = -1;
+    nodeCache = 0;
+    profileMemLimit = 0;
     startRow = -1;
     endRow = -1;
 
@@ -133,6 +147,8 @@ Args::Args() {
     ofoTopLabels = 1000;
     ofoA = 10;
     ofoB = 20;
+    ofoSyncInterval = 100;
+    compactOutput = "";
 
     psA = 0.55;
     psB = 1.5;
@@ -167,7 +183,9 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                     threads = getCpuCount();
                 else if (threads == -1)
                     threads = getCpuCount() - 1;
-            } else if (args[ai] == "--memLimit") {
+            } else if (args[ai] == "--numa")
+                numa = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--memLimit") {
                 memLimit = static_cast<unsigned long long>(std::stof(args.at(ai + 1)) * 1024 * 1024 * 1024);
                 if (memLimit == 0) memLimit = getSystemMemory();
             } else if (args[ai] == "--saveGrads")
@@ -195,6 +213,8 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                 ensemble = std::stoi(args.at(ai + 1));
             else if (args[ai] == "--ensOnTheTrot")
                 ensOnTheTrot = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--ensParallel")
+                ensParallel = std::stoi(args.at(ai + 1));
             else if (args[ai] == "-m" || args[ai] == "--model") {
                 modelName = args.at(ai + 1);
                 if (args.at(ai + 1) == "br")
@@ -284,10 +304,28 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                 tmax = std::stoi(args.at(ai + 1));
             else if (args[ai] == "--adagradEps")
                 adagradEps = std::stof(args.at(ai + 1));
+            else if (args[ai] == "--streamTrain")
+                streamTrain = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--streamCache")
+                streamCache = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--hogwild")
+                hogwild = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--miniBatch")
+                miniBatch = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--snapshotInterval")
+                snapshotInterval = std::stof(args.at(ai + 1));
+            else if (args[ai] == "--checkpointInterval")
+                checkpointInterval = std::stof(args.at(ai + 1));
             else if (args[ai] == "--l2Penalty")
                 l2Penalty = std::stof(args.at(ai + 1));
+            else if (args[ai] == "--l1Penalty")
+                l1Penalty = std::stof(args.at(ai + 1));
             else if (args[ai] == "--dims")
                 dims = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--quantize")
+                quantize = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--quantizeOutput")
+                quantizeOutput = std::stoi(args.at(ai + 1)) != 0;
             else if (args[ai] == "--autoCLin")
                 autoCLin = std::stoi(args.at(ai + 1)) != 0;
             else if (args[ai] == "--autoCLog")
@@ -340,9 +378,11 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
 
             // MACH options
             else if (args[ai] == "--machHashes")
-                machHashes = std::stoi(args.at(ai + 1)) != 0;
+                machHashes = std::stoi(args.at(ai + 1));
             else if (args[ai] == "--machBuckets")
-                machBuckets = std::stoi(args.at(ai + 1)) != 0;
+                machBuckets = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--machTopBuckets")
+                machTopBuckets = std::stoi(args.at(ai + 1));
 
             // OFO options
             else if (args[ai] == "--ofoType") {
@@ -361,6 +401,10 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                 ofoA = std::stoi(args.at(ai + 1));
             else if (args[ai] == "--ofoB")
                 ofoB = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--ofoSyncInterval")
+                ofoSyncInterval = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--compactOutput")
+                compactOutput = args.at(ai + 1);
 
             // Prediction/test options
             else if (args[ai] == "--topK")
@@ -389,6 +433,10 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                 beamSearchUnpack = std::stoi(args.at(ai + 1)) != 0;
             else if (args[ai] == "--batchRows")
                 batchRows = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--nodeCache")
+                nodeCache = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--profileMemLimit")
+                profileMemLimit = static_cast<unsigned long long>(std::stof(args.at(ai + 1)) * 1024 * 1024 * 1024);
             else if (args[ai] == "--startRow")
                 startRow = std::stoi(args.at(ai + 1));
             else if (args[ai] == "--endRow")
@@ -454,6 +502,61 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
         treeTypeName = "onlineBestScore";
     }
 
+    if (streamTrain && modelType != oplt && modelType != extremeText)
+        throw std::invalid_argument("Streaming training is supported only by Online PLT and extremeText models");
+
+    if (streamTrain && modelType == oplt && (treeType != onlineRandom && treeType != onlineBestScore)) {
+        if (countArg(args, "--treeType"))
+            Log(CERR) << "Warning: Streaming training for Online PLT does not support " << treeTypeName
+            << " tree type! Changing to onlineBestScore.\n";
+        treeType = onlineBestScore;
+        treeTypeName = "onlineBestScore";
+    }
+
+    // Only trees built from labels' priors are supported, the stream is not kept in memory
+    if (streamTrain && modelType == extremeText
+        && (treeType == hierarchicalKmeans || (treeType >= onlineKaryComplete && treeType < custom))) {
+        if (countArg(args, "--treeType"))
+            Log(CERR) << "Warning: Streaming training for extremeText does not support " << treeTypeName
+            << " tree type! Changing to huffman.\n";
+        treeType = huffman;
+        treeTypeName = "huffman";
+    }
+
+    if (hogwild && modelType != oplt)
+        throw std::invalid_argument("Hogwild training is supported only by Online PLT model");
+
+    if (hogwild && streamTrain && hash == 0)
+        throw std::invalid_argument("Hogwild training on data stream requires fixed features space, use --hash option");
+
+    if (ensParallel < 1)
+        throw std::invalid_argument("Number of ensemble members trained concurrently must be a positive number");
+
+    if (miniBatch < 1)
+        throw std::invalid_argument("Mini-batch size must be a positive number");
+
+    if (miniBatch > 1 && modelType != oplt)
+        throw std::invalid_argument("Mini-batch updates are supported only by Online PLT model");
+
+    if (snapshotInterval > 0 && modelType != oplt)
+        throw std::invalid_argument("Snapshots for prediction during training are supported only by Online PLT model");
+
+    if (checkpointInterval > 0 && modelType != oplt)
+        throw std::invalid_argument("Checkpointing during training is supported only by Online PLT model");
+
+    if (ofoSyncInterval < 1)
+        throw std::invalid_argument("Number of examples between synchronizations of OFO must be a positive number");
+
+    if (nodeCache < 0)
+        throw std::invalid_argument("Size of node cache must be a non-negative number");
+
+    if (machTopBuckets < 0)
+        throw std::invalid_argument("Number of top buckets for MACH prediction must be a non-negative number");
+
+    // Model type of test and predict commands is known only after loading the model
+    if ((quantize || quantizeOutput) && countArgs(args, {"-m", "--model"}) && modelType != extremeText)
+        throw std::invalid_argument("Quantization of weights is supported only by extremeText model");
+
     // If only threshold used set topK to 0, otherwise display warning
     if (threshold > 0) {
         if (countArg(args, "--topK"))
@@ -484,6 +587,8 @@ void Args::printArgs(std::string command) {
     Log(CERR) << "\n  Model: " << output << "\n    Type: " << modelName;
     if (ensemble > 1){
         Log(CERR) << ", ensemble: " << ensemble;
+        if (command == "train" && ensParallel > 1)
+            Log(CERR) << ", members trained concurrently: " << std::min(ensParallel, ensemble);
         if (command == "test" || command == "predict")
             Log(CERR) << ", sequantial ens. pred.: " << ensOnTheTrot << ", predict missing scores: " << ensMissingScores;
     }
@@ -496,7 +601,19 @@ void Args::printArgs(std::string command) {
         else
             Log(CERR) << "\n    Loss: " << lossName << ", eta: " << eta << ", epochs: " << epochs;
         if (optimizerType == adagrad) Log(CERR) << ", AdaGrad eps " << adagradEps;
+        if ((optimizerType != liblinear || modelType == extremeText) && (l1Penalty > 0 || l2Penalty > 0))
+            Log(CERR) << ", L1 penalty: " << l1Penalty << ", L2 penalty: " << l2Penalty;
         Log(CERR) << ", weights threshold: " << weightsThreshold;
+        if (streamTrain) Log(CERR) << "\n  Streaming training, cache: " << streamCache;
+        if (hogwild) Log(CERR) << "\n  Hogwild (lock-free) updates of dense weights";
+        if (miniBatch > 1) Log(CERR) << "\n  Mini-batch updates of base classifiers, size: " << miniBatch;
+        if (snapshotInterval > 0) Log(CERR) << "\n  Snapshots for prediction published every " << snapshotInterval << " s";
+        if (checkpointInterval > 0) Log(CERR) << "\n  Checkpoints written every " << checkpointInterval << " s";
+        if (modelType == extremeText) {
+            Log(CERR) << "\n  Dims: " << dims;
+            if (quantize || quantizeOutput)
+                Log(CERR) << ", quantized input vectors: " << quantize << ", quantized tree node vectors: " << quantizeOutput;
+        }
 
         // Tree related
         if (modelType == plt || modelType == hsm || modelType == oplt) {
@@ -525,16 +642,32 @@ void Args::printArgs(std::string command) {
             Log(CERR) << "\n  Tree search type: " << treeSearchName;
             if(treeSearchType == beam && threshold <= 0 && thresholds.empty())
                 Log(CERR) << ", beam search width: " << beamSearchWidth;
+            if(nodeCache > 0)
+                Log(CERR) << ", node cache size: " << nodeCache;
+            if(profileMemLimit > 0)
+                Log(CERR) << "\n  Base classifiers memory limit for nodes profile: " << formatMem(profileMemLimit);
+        }
+        if (modelType == mach) {
+            if (machTopBuckets > 0) Log(CERR) << "\n  Candidates from top buckets per hash: " << machTopBuckets;
+            else Log(CERR) << "\n  Exact (brute force) prediction";
         }
         Log(CERR) << "\n  Base classifiers representation: " << representationName << " vector";
         if(thresholds.empty()) Log(CERR) << "\n  Top k: " << topK << ", threshold: " << threshold;
         else Log(CERR) << "\n  Thresholds: " << thresholds;
     }
 
+    if (command == "compact") {
+        Log(CERR) << "\n  Compacted model: " << compactOutput;
+        if (weightsThreshold > 0) Log(CERR) << "\n    Weights threshold: " << weightsThreshold;
+    }
+
     if (command == "ofo")
-        Log(CERR) << "\n  Epochs: " << epochs << ", initial a: " << ofoA << ", initial b: " << ofoB;
+        Log(CERR) << "\n  Epochs: " << epochs << ", initial a: " << ofoA << ", initial b: " << ofoB
+        << ", sync interval: " << ofoSyncInterval;
 
-    Log(CERR) << "\n  Threads: " << threads << ", memory limit: " << formatMem(memLimit)
+    Log(CERR) << "\n  Threads: " << threads << ", memory limit: " << formatMem(memLimit);
+    if (numa) Log(CERR) << ", NUMA nodes: " << NumaBind::numaNodes();
+    Log(CERR)
     << "\n  Seed: " << seed << "\n";
 }
 
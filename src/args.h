@@ -34,16 +34,19 @@ public:
     Args();
 
     inline int getSeed() { return rngSeeder(); };
+    inline void setSeed(int newSeed) { seed = newSeed; rngSeeder.seed(newSeed); };
     void parseArgs(const std::vector<std::string>& args, bool keepArgs = true);
     void printArgs(std::string command = "");
     int countArg(const std::vector<std::string>& args, std::string to_count);
     int countArgs(const std::vector<std::string>& args, std::vector<std::string> to_count);
+    inline bool isArgSet(const std::string& arg) { return countArg(parsedArgs, arg) > 0; }; // Set by parsed args
     void save(std::ofstream& out) override;
     void load(std::ifstream& in) override;
 
     // Threading, memory and seed options
     int seed;
     int threads;
+    bool numa;
     unsigned long long memLimit; // TODO: Implement this for some models
     bool saveGrads;
     bool resume;
@@ -77,14 +80,22 @@ public:
     // Ensemble options
     int ensemble;
     bool ensOnTheTrot;
+    int ensParallel;
     bool ensMissingScores;
 
     // For online training
     Real eta;
     int epochs;
     Real l2Penalty;
+    Real l1Penalty;
     int tmax;
     Real adagradEps;
+    bool streamTrain;
+    bool streamCache;
+    bool hogwild;
+    int miniBatch;
+    Real snapshotInterval;
+    Real checkpointInterval;
 
     // Tree models
 
@@ -105,10 +116,13 @@ public:
 
     // extremeText options
     size_t dims;
+    bool quantize;
+    bool quantizeOutput;
 
     // MACH options
     int machHashes;
     int machBuckets;
+    int machTopBuckets;
 
     // Prediction options
     int topK;
@@ -120,6 +134,8 @@ public:
     int beamSearchWidth;
     bool beamSearchUnpack;
     int batchRows;
+    int nodeCache;
+    unsigned long long profileMemLimit;
     int startRow;
     int endRow;
     int predictionPrecision;
@@ -134,6 +150,10 @@ public:
     Real ofoTopLabels;
     Real ofoA;
     Real ofoB;
+    int ofoSyncInterval;
+
+    // Compaction options
+    std::string compactOutput;
 
     Real psA;
     double psB;
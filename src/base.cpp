@@ -20,6 +20,7 @@
  SOFTWARE.
  */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <random>
@@ -40,9 +41,11 @@ Base::Base() {
     firstClass = 0;
     firstClassCount = 0;
     t = 0;
+    promotedToDense = false;
 
     W = nullptr;
     G = nullptr;
+    U = nullptr;
 }
 
 Base::Base(Args& args): Base(){
@@ -50,10 +53,16 @@ Base::Base(Args& args): Base(){
         setupOnlineTraining(args);
 }
 
+Base::Base(Args& args, size_t denseSize): Base(){
+    if(args.optimizerType != liblinear)
+        setupOnlineTraining(args, denseSize, denseSize != 0);
+}
+
 Base::~Base() { clear(); }
 
 void Base::update(Real label, Feature* features, Args& args) {
     std::lock_guard<std::mutex> lock(updateMtx);
+    if (W == nullptr) return; // Base was set as dummy in the meantime
 
     unsafeUpdate(label, features, args);
 }
@@ -64,22 +73,84 @@ void Base::unsafeUpdate(Real label, Feature* features, Args& args) {
     ++t;
     if (label == firstClass) ++firstClassCount;
 
-    Real pred = W->dot(features);
-    Real grad = gradFunc(label, pred, 0); // Online version doesn't support weights  right now
+    Real grad = computeGrad(label, features, args);
+    applyGrad(features, grad, args);
+    checkDensity(t - 1);
+}
+
+void Base::updateBatch(const std::vector<std::pair<Real, Feature*>>& examples, Args& args) {
+    std::lock_guard<std::mutex> lock(updateMtx);
+    if (W == nullptr) return; // Base was set as dummy in the meantime
+
+    unsafeUpdateBatch(examples, args);
+}
+
+void Base::unsafeUpdateBatch(const std::vector<std::pair<Real, Feature*>>& examples, Args& args) {
+    // Sum of gradients of the examples, so a step has the same scale as the per-example updates
+    thread_local UnorderedMap<int, Real> gradSum;
+    thread_local std::vector<Feature> merged;
+    gradSum.clear();
+
+    int startT = t;
+    for (const auto& e : examples) {
+        if (args.tmax != -1 && args.tmax < t) break;
+
+        ++t;
+        if (e.first == firstClass) ++firstClassCount;
+
+        Real grad = computeGrad(e.first, e.second, args);
+        if (grad == 0) continue;
+        for (Feature* f = e.second; f->index != -1; ++f) gradSum[f->index] += grad * f->value;
+    }
+
+    if (!gradSum.empty()) {
+        merged.clear();
+        merged.reserve(gradSum.size() + 1);
+        for (const auto& g : gradSum) merged.push_back({g.first, g.second});
+        // Sequential writes to weights
+        std::sort(merged.begin(), merged.end(), [](const Feature& a, const Feature& b) { return a.index < b.index; });
+        merged.push_back({-1, 0});
+        applyGrad(merged.data(), 1.0, args);
+    }
+    checkDensity(startT);
+}
+
+Real Base::computeGrad(Real label, Feature* features, Args& args) {
+    // Dense weights promoted from map may need to grow to cover new features, features are sorted
+    if (promotedToDense) {
+        Feature* f = features;
+        while (f->index != -1) ++f;
+        if (f != features && static_cast<size_t>((f - 1)->index) >= W->size()) {
+            size_t newSize = std::max(static_cast<size_t>((f - 1)->index) + 1, W->size() + W->size() / 8);
+            W->resize(newSize);
+            if (G != nullptr) G->resize(newSize);
+            if (U != nullptr) U->resize(newSize);
+        }
+    }
+
+    // Apply regularization of the steps in which features of this example were skipped
+    Real pred = (U != nullptr) ? regularizeLazilyAndDot(*W, *G, *U, features, t, args) : W->dot(features);
+    return gradFunc(label, pred, 0); // Online version doesn't support weights  right now
+}
 
+void Base::applyGrad(Feature* features, Real grad, Args& args) {
     if (args.optimizerType == sgd)
         updateSGD(*W, *G, features, grad, t, args);
     else if (args.optimizerType == adagrad)
         updateAdaGrad(*W, *G, features, grad, t, args);
     else throw std::invalid_argument("Unknown optimizer type");
+}
 
-    // Check if we should change sparse W to dense W
-    /*
-    if (mapW != nullptr && wSize != 0) {
-        nonZeroW = mapW->size();
-        if (mapSize() > denseSize()) toDense();
+void Base::checkDensity(int prevT) {
+    // Check if we should change map W to dense W, it is only possible while W is not dense,
+    // so never during hogwild updates, otherwise the caller holds the update lock
+    if (W->type() == map && t / denseCheckInterval != prevT / denseCheckInterval) {
+        W->checkD(); // Updates size and number of non-zero weights
+        if (Vector::estimateMem(W->size(), W->nonZero()) < MapVector::estimateMem(W->size(), W->nonZero())) {
+            toDense(W->size());
+            promotedToDense = true;
+        }
     }
-     */
 }
 
 void Base::trainLiblinear(ProblemData& problemData, Args& args) {
@@ -91,9 +162,9 @@ void Base::trainLiblinear(ProblemData& problemData, Args& args) {
 
 
 
-    problem P = {/*.l =*/ static_cast<int>(problemData.binLabels.size()),
+    problem P = {/*.l =*/ static_cast<int>(problemData.binLabels->size()),
                  /*.n =*/ problemData.n,
-                 /*.y =*/ problemData.binLabels.data(),
+                 /*.y =*/ problemData.binLabels->data(),
                  /*.x =*/ reinterpret_cast<feature_node**>(problemData.binFeatures.data()),
                  /*.bias =*/ -1,
                  /*.W =*/ problemData.instancesWeights.data()};
@@ -140,6 +211,8 @@ void Base::trainOnline(ProblemData& problemData, Args& args) {
 
     Vector* newW = new Vector(problemData.n);
     Vector* newG = nullptr;
+    UpdateSteps* newU = nullptr;
+    if (args.l1Penalty > 0 || args.l2Penalty > 0) newU = new UpdateSteps(problemData.n);
 
     // Set update function
     void (*updateFunc)(Vector&, Vector&, Feature*, Real, int, Args&);
@@ -153,18 +226,20 @@ void Base::trainOnline(ProblemData& problemData, Args& args) {
     else
         throw std::invalid_argument("Unknown online update function type");
 
+    const std::vector<Real>& binLabels = *problemData.binLabels;
     const int examples = problemData.binFeatures.size();
     for (int e = 0; e < args.epochs; ++e)
         for (int r = 0; r < examples; ++r) {
-            Real label = problemData.binLabels[r];
+            Real label = binLabels[r];
             Feature* features = problemData.binFeatures[r];
 
             if (args.tmax != -1 && args.tmax < t) break;
 
             ++t;
-            if (problemData.binLabels[r] == firstClass) ++firstClassCount;
+            if (binLabels[r] == firstClass) ++firstClassCount;
 
-            Real pred = newW->dot(features);
+            Real pred = (newU != nullptr) ? regularizeLazilyAndDot(*newW, *newG, *newU, features, t, args)
+                                          : newW->dot(features);
             Real grad = gradFunc(label, pred, problemData.invPs) * problemData.instancesWeights[r];
             if (!std::isinf(grad) && !std::isnan(grad))
                 updateFunc(*newW, *newG, features, grad, t, args);
@@ -172,28 +247,49 @@ void Base::trainOnline(ProblemData& problemData, Args& args) {
 
     W = newW;
     G = newG;
+    U = newU;
+    if (U != nullptr) {
+        finalizeRegularization(args);
+        delete U;
+        U = nullptr;
+    }
 }
 
 void Base::train(ProblemData& problemData, Args& args) {
     // Delete previous weights
     delete W;
     delete G;
+    delete U;
+    U = nullptr;
 
     // Set loss function
     setLoss(args.lossType);
 
-    if (problemData.binLabels.empty()) {
+    if (problemData.binLabels == nullptr) {
+        std::vector<Real> binLabels(problemData.size(), 0);
+        for (const auto& r : *problemData.positiveRows) binLabels[r] = 1.0;
+
+        ProblemData denseProblemData(binLabels, problemData.binFeatures, problemData.n, problemData.instancesWeights);
+        denseProblemData.invPs = problemData.invPs;
+        denseProblemData.r = problemData.r;
+        train(denseProblemData, args);
+        problemData.loss = denseProblemData.loss;
+        return;
+    }
+
+    const std::vector<Real>& binLabels = *problemData.binLabels;
+    if (binLabels.empty()) {
         firstClass = 0;
         classCount = 0;
         return;
     }
 
-    assert(problemData.binLabels.size() == problemData.binFeatures.size());
-    assert(problemData.instancesWeights.size() >= problemData.binLabels.size());
+    assert(binLabels.size() == problemData.binFeatures.size());
+    assert(problemData.instancesWeights.size() >= binLabels.size());
 
-    int positiveLabels = std::count(problemData.binLabels.begin(), problemData.binLabels.end(), 1.0);
-    if (positiveLabels == 0 || positiveLabels == problemData.binLabels.size()) {
-        firstClass = static_cast<int>(problemData.binLabels[0]);
+    int positiveLabels = std::count(binLabels.begin(), binLabels.end(), 1.0);
+    if (positiveLabels == 0 || positiveLabels == binLabels.size()) {
+        firstClass = static_cast<int>(binLabels[0]);
         classCount = 1;
         return;
     }
@@ -206,7 +302,7 @@ void Base::train(ProblemData& problemData, Args& args) {
         problemData.labels[1] = 1;
         problemData.labelsWeights = new Real[2];
 
-        int negativeLabels = static_cast<int>(problemData.binLabels.size()) - positiveLabels;
+        int negativeLabels = static_cast<int>(binLabels.size()) - positiveLabels;
         if (negativeLabels > positiveLabels) {
             problemData.labelsWeights[0] = 1.0;
             problemData.labelsWeights[1] = 1.0 + log(static_cast<Real>(negativeLabels) / positiveLabels);
@@ -226,7 +322,7 @@ void Base::train(ProblemData& problemData, Args& args) {
         for (int r = 0; r < examples; ++r) {
             Real pred =  W->dot(problemData.binFeatures[r]);
             if (firstClass == 0) pred *= -1;
-            const Real loss = lossFunc(problemData.binLabels[r], pred, problemData.invPs);
+            const Real loss = lossFunc(binLabels[r], pred, problemData.invPs);
             if (!std::isinf(loss) && !std::isnan(loss)) meanLoss += loss;
         }
         meanLoss /= examples;
@@ -253,9 +349,11 @@ void Base::setupOnlineTraining(Args& args, int n, bool startWithDenseW) {
     if (n != 0 && startWithDenseW) {
         W = new Vector(n);
         if (args.optimizerType == adagrad) G = new Vector(n);
+        if (args.l1Penalty > 0 || args.l2Penalty > 0) U = new UpdateSteps(n);
     } else {
         W = new MapVector();
         if (args.optimizerType == adagrad) G = new MapVector();
+        if (args.l1Penalty > 0 || args.l2Penalty > 0) U = new UpdateSteps(0, false);
     }
 
     classCount = 2;
@@ -271,7 +369,17 @@ void Base::finalizeOnlineTraining(Args& args) {
         if (firstClassCount == 0) firstClass = 1 - firstClass;
     }
     */
+    finalizeRegularization(args);
     pruneWeights(args.weightsThreshold);
+
+    // Go back to map if weights promoted to dense became sparse after pruning
+    if (promotedToDense && W != nullptr) {
+        W->checkD();
+        if (MapVector::estimateMem(W->size(), W->nonZero()) < Vector::estimateMem(W->size(), W->nonZero())) {
+            to(map);
+            promotedToDense = false;
+        }
+    }
 }
 
 Real Base::predictValue(SparseVector& features) {
@@ -292,15 +400,23 @@ Real Base::predictProbability(SparseVector& features) {
     return val;
 }
 
+Real Base::lockedPredictProbability(SparseVector& features) {
+    std::lock_guard<std::mutex> lock(updateMtx);
+    return predictProbability(features);
+}
+
 void Base::clear() {
     classCount = 0;
     firstClass = 0;
     firstClassCount = 0;
     t = 0;
+    promotedToDense = false;
     delete W;
     W = nullptr;
     delete G;
     G = nullptr;
+    delete U;
+    U = nullptr;
 }
 
 void Base::pruneWeights(Real threshold) {
@@ -311,6 +427,27 @@ void Base::pruneWeights(Real threshold) {
     }
 }
 
+void Base::compact(Real threshold) {
+    delete G;
+    G = nullptr;
+    delete U;
+    U = nullptr;
+    if (W == nullptr) return;
+    if (threshold > 0) pruneWeights(threshold);
+
+    // Size ends at the last non-zero weight, so the representation chosen while loading fits the weights
+    size_t s = 0;
+    W->forEachIV([&](const int& i, Real& v) {
+        if (v != 0 && i >= s) s = i + 1;
+    });
+    auto newW = new MapVector(s, W->nonZero());
+    W->forEachIV([&](const int& i, Real& v) {
+        if (v != 0) newW->insertD(i, v);
+    });
+    delete W;
+    W = newW;
+}
+
 void Base::save(std::ofstream& out, bool saveGrads) {
     saveVar(out, classCount);
     saveVar(out, firstClass);
@@ -402,9 +539,43 @@ void Base::setFirstClass(int first){
 }
 
 Base* Base::copy() {
+    std::lock_guard<std::mutex> lock(updateMtx);
     Base* c = new Base();
     if (W != nullptr) c->W = W->copy();
     if (G != nullptr) c->G = G->copy();
+    if (U != nullptr) c->U = new UpdateSteps(*U);
+
+    c->firstClass = firstClass;
+    c->classCount = classCount;
+    c->lossType = lossType;
+    c->lossFunc = lossFunc;
+    c->gradFunc = gradFunc;
+    c->t = t;
+    c->firstClassCount = firstClassCount;
+    c->promotedToDense = promotedToDense;
+
+    return c;
+}
+
+Base* Base::copyForPrediction(Args& args) {
+    std::lock_guard<std::mutex> lock(updateMtx);
+    Base* c = new Base();
+    if (W != nullptr) {
+        c->W = W->copy();
+        if (U != nullptr) {
+            c->W->forEachIV([&](const int& i, Real& w) {
+                int u = U->at(i);
+                if (u < t) w = lazyPenalty(w, lazyRate(G, i, u, t, args), t - u, args.l1Penalty, args.l2Penalty);
+            });
+        }
+
+        // Preallocated or promoted dense weights may be sparse
+        if (c->W->type() == dense) {
+            c->W->checkD();
+            if (MapVector::estimateMem(c->W->size(), c->W->nonZero()) < Vector::estimateMem(c->W->size(), c->W->nonZero()))
+                c->to(map);
+        }
+    }
 
     c->firstClass = firstClass;
     c->classCount = classCount;
@@ -436,6 +607,64 @@ void Base::to(RepresentationType type) {
         delete G;
         G = newG;
     }
+    if (U != nullptr) { // Steps are only dense or in map
+        if (type == dense) U->toDense(W != nullptr ? W->size() : 0);
+        else U->toMap();
+    }
+}
+
+void Base::toDense(size_t minSize) {
+    // Size of online updated vectors is not tracked, so check the indices, all vectors have to be of the same size
+    size_t s = minSize;
+    if (U != nullptr) s = std::max(s, U->size());
+    for (auto vec : {W, G}) {
+        if (vec == nullptr) continue;
+        s = std::max(s, vec->size());
+        vec->forEachIV([&](const int& i, Real& v) { if (static_cast<size_t>(i) >= s) s = i + 1; });
+    }
+
+    auto toDenseVec = [&](AbstractVector* vec) -> AbstractVector* {
+        if (vec == nullptr) return nullptr;
+        auto newVec = new Vector(s);
+        vec->forEachIV([&](const int& i, Real& v) { newVec->insertD(i, v); });
+        delete vec;
+        return newVec;
+    };
+
+    W = toDenseVec(W);
+    G = toDenseVec(G);
+    if (U != nullptr) U->toDense(s);
+}
+
+void Base::finalizeRegularization(Args& args) {
+    if (U == nullptr) return;
+
+    // Bring all weights up to date with regularization of the skipped steps
+    W->forEachIV([&](const int& i, Real& w) {
+        int u = U->at(i);
+        if (u < t) {
+            w = lazyPenalty(w, lazyRate(G, i, u, t, args), t - u, args.l1Penalty, args.l2Penalty);
+            (*U)[i] = t;
+        }
+    });
+}
+
+void Base::resumeOnlineTraining(Args& args) {
+    if (W == nullptr) return;
+    bool isDense = W->type() == dense;
+
+    // AdaGrad accumulators are saved only with --saveGrads, without them they start again from 0
+    if (args.optimizerType == adagrad && G == nullptr) {
+        if (isDense) G = new Vector(W->size());
+        else G = new MapVector();
+    }
+
+    // Weights are saved fully regularized and steps are not saved, so both the steps and t start from 0
+    if (U == nullptr && (args.l1Penalty > 0 || args.l2Penalty > 0)) {
+        t = 0;
+        if (isDense) U = new UpdateSteps(W->size());
+        else U = new UpdateSteps(0, false);
+    }
 }
 
 RepresentationType Base::getType() {
@@ -447,6 +676,7 @@ unsigned long long Base::mem(){
     unsigned long long totalMem = sizeof(Base);
     if(W != nullptr) totalMem += W->mem();
     if(G != nullptr) totalMem += G->mem();
+    if(U != nullptr) totalMem += U->mem();
     return totalMem;
 }
 
@@ -22,6 +22,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <string>
@@ -35,7 +36,8 @@
 
 
 struct ProblemData {
-    std::vector<Real>& binLabels;
+    std::vector<Real>* binLabels; // nullptr if labels are given as positive rows
+    const std::vector<int>* positiveRows; // Compact labels, rows of positive examples, all other rows are negative
     std::vector<Feature*>& binFeatures;
     std::vector<Real>& instancesWeights;
     int n; // features space size
@@ -48,24 +50,92 @@ struct ProblemData {
     Real loss;
 
     ProblemData(std::vector<Real>& binLabels, std::vector<Feature*>& binFeatures, int n, std::vector<Real>& instancesWeights):
-                binLabels(binLabels), binFeatures(binFeatures), n(n), instancesWeights(instancesWeights) {
+                binLabels(&binLabels), positiveRows(nullptr), binFeatures(binFeatures), n(n), instancesWeights(instancesWeights) {
         labelsCount = 0;
         labels = NULL;
         labelsWeights = NULL;
         invPs = 1.0;
         r = 0;
     }
+
+    // Labels are materialized only for the time of training of the base
+    ProblemData(const std::vector<int>& positiveRows, std::vector<Feature*>& binFeatures, int n, std::vector<Real>& instancesWeights):
+                binLabels(nullptr), positiveRows(&positiveRows), binFeatures(binFeatures), n(n), instancesWeights(instancesWeights) {
+        labelsCount = 0;
+        labels = NULL;
+        labelsWeights = NULL;
+        invPs = 1.0;
+        r = 0;
+    }
+
+    inline size_t size() const { return binFeatures.size(); }
 };
 
 
+// Steps of the last updates of weights for lazy regularization, kept as integers, so they stay exact
+// for any number of steps, Real would round them above 2^24 steps of a single base.
+// Like weights, they are either dense or stored in a map.
+class UpdateSteps {
+public:
+    explicit UpdateSteps(size_t s = 0, bool dense = true): isDense(dense), d(dense ? s : 0) {}
+
+    inline int at(int index) const {
+        if (isDense) return (static_cast<size_t>(index) < d.size()) ? d[index] : 0;
+        auto it = m.find(index);
+        return (it != m.end()) ? it->second : 0;
+    }
+    inline int& operator[](int index) { return isDense ? d[index] : m[index]; }
+
+    void resize(size_t newS) { if (isDense) d.resize(newS); }
+
+    // Size of the dense vector that can hold all steps
+    size_t size() const {
+        if (isDense) return d.size();
+        size_t s = 0;
+        for (const auto& p : m) s = std::max(s, static_cast<size_t>(p.first) + 1);
+        return s;
+    }
+
+    void toDense(size_t s) {
+        if (isDense) return resize(std::max(s, d.size()));
+        d.assign(std::max(s, size()), 0);
+        for (const auto& p : m) d[p.first] = p.second;
+        m.clear();
+        isDense = true;
+    }
+
+    void toMap() {
+        if (!isDense) return;
+        for (size_t i = 0; i < d.size(); ++i) if (d[i] != 0) m[i] = d[i];
+        d.clear();
+        d.shrink_to_fit();
+        isDense = false;
+    }
+
+    unsigned long long mem() const {
+        unsigned long long mem = sizeof(UpdateSteps) + d.capacity() * sizeof(int);
+        if (!m.empty()) mem += (m.mask() + 1) * (2 * sizeof(int));
+        return mem;
+    }
+
+private:
+    bool isDense;
+    std::vector<int> d;
+    UnorderedMap<int, int> m;
+};
+
 class Base {
 public:
     Base();
     Base(Args& args);
+    Base(Args& args, size_t denseSize); // Online base with preallocated dense weights
     ~Base();
 
     void update(Real label, Feature* feature, Args& args);
     void unsafeUpdate(Real label, Feature* feature, Args& args);
+    // Merged update with the sum of gradients of the (label, features) examples
+    void updateBatch(const std::vector<std::pair<Real, Feature*>>& examples, Args& args);
+    void unsafeUpdateBatch(const std::vector<std::pair<Real, Feature*>>& examples, Args& args);
     void train(ProblemData& problemData, Args& args);
     void trainLiblinear(ProblemData& problemData, Args& args);
     void trainOnline(ProblemData& problemData, Args& args);
@@ -76,6 +146,7 @@ public:
 
     Real predictValue(SparseVector& features);
     Real predictProbability(SparseVector& features);
+    Real lockedPredictProbability(SparseVector& features); // Safe to call while other threads update the base
 
     inline AbstractVector* getW() { return W; };
     inline AbstractVector* getG() { return G; };
@@ -85,11 +156,19 @@ public:
 
     unsigned long long mem();
     inline int getFirstClass() { return firstClass; }
+    inline int getUpdatesCount() {
+        std::lock_guard<std::mutex> lock(updateMtx);
+        return t;
+    }
     void clear();
 
     void to(RepresentationType type); // Change representation type of base classifier
+    void toDense(size_t minSize); // Change to dense representation of at least given size
+    void finalizeRegularization(Args& args); // Apply pending lazy regularization to all weights
+    void resumeOnlineTraining(Args& args); // Recreate the state of online training that is not saved with the weights
     RepresentationType getType();
     void pruneWeights(Real threshold);
+    void compact(Real threshold); // Prune weights if threshold > 0, keep only non-zero weights and drop gradients
     void setFirstClass(int first);
     void setLoss(LossType);
 
@@ -98,9 +177,15 @@ public:
 
     Base* copy();
     Base* copyInverted();
+    Base* copyForPrediction(Args& args); // Copy of only the weights, with pending regularization applied
 
     bool isDummy() { return (classCount < 2); }
-    void setDummy() { clear(); }
+    void setDummy(bool freeWeights = true) {
+        // Weights can be kept if other threads may still be updating them without locking
+        std::lock_guard<std::mutex> lock(updateMtx);
+        if (freeWeights) clear();
+        else classCount = 0;
+    }
 
 private:
     std::mutex updateMtx;
@@ -113,9 +198,19 @@ private:
     int firstClassCount;
     int t;
 
+    // Online training starts with map weights that are promoted to dense when it saves memory
+    static const int denseCheckInterval = 1024;
+    bool promotedToDense;
+
     // Weights (parameters)
     AbstractVector* W;
     AbstractVector* G;
+    UpdateSteps* U; // Steps of the last updates of weights, for lazy regularization
 
     AbstractVector* vecTo(AbstractVector*, RepresentationType type);
+
+    // Parts of online update
+    Real computeGrad(Real label, Feature* features, Args& args);
+    void applyGrad(Feature* features, Real grad, Args& args);
+    void checkDensity(int prevT);
 };
@@ -70,6 +70,7 @@ struct Prediction{
     Prediction(int label, double value): label(label), value(value) {};
 
     bool operator<(const Prediction& r) const { return value < r.value; };
+    bool operator>(const Prediction& r) const { return value > r.value; };
 
     friend std::ostream& operator<<(std::ostream& os, const Prediction& fn) {
         os << fn.label << ":" << fn.value;
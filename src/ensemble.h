@@ -22,11 +22,15 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "log.h"
 #include "model.h"
+#include "threads.h"
 
 struct EnsemblePrediction {
     int label;
@@ -45,20 +49,39 @@ public:
     void train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) override;
     void predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) override;
     Real predictForLabel(Label label, SparseVector& features, Args& args) override;
+    std::vector<Real> predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) override;
     std::vector<std::vector<Prediction>> predictBatch(SRMatrix& features, Args& args) override;
 
     void setLabelsWeights(std::vector<Real> lw) override;
     void setLabelsBiases(std::vector<Real> lb) override;
 
     void load(Args& args, std::string infile) override;
+    void compact(Args& args, const std::string& infile, const std::string& outfile) override;
+    void profile(SRMatrix& features, Args& args, const std::string& infile) override;
 
     void printInfo() override;
 
 protected:
     std::vector<T*> members;
     T* loadMember(Args& args, const std::string& infile, int memberNo);
+    static void trainMember(SRMatrix& labels, SRMatrix& features, Args& args, const std::string& output, int memberNo,
+                            SRMatrix* labelsFeatures);
+    static void trainMembersThread(SRMatrix& labels, SRMatrix& features, std::vector<Args>& membersArgs,
+                                   const std::string& output, SRMatrix* labelsFeatures, std::atomic<int>& nextMember);
+
+    // Calls func for each member, if members are loaded on the trot, the next member is loaded in the background
+    void forEachMember(Args& args, const std::function<void(T*, int)>& func);
+
+    static void predictMembersThread(std::vector<T*>& members, std::vector<std::vector<std::vector<Prediction>>>& membersPredictions,
+                                     SRMatrix& features, Args& args, std::atomic<int>& nextMember);
+    static void predictMissingScoresThread(T* member, int memberNo,
+                                           std::vector<UnorderedMap<int, EnsemblePrediction>>& ensemblePredictions,
+                                           SRMatrix& features, Args& args, std::atomic<int>& nextRow,
+                                           std::atomic<int>& doneRows, const int chunkRows);
     void accumulatePrediction(UnorderedMap<int, EnsemblePrediction>& ensemblePredictions,
                               std::vector<Prediction>& prediction, int memberNo);
+    static void addMissingScores(T* member, int memberNo, UnorderedMap<int, EnsemblePrediction>& ensemblePredictions,
+                                 SparseVector& features, Args& args);
 
     void accumulatePrediction(UnorderedMap<int, Prediction>& ensemblePredictions,
                               std::vector<Prediction>& prediction);
@@ -74,18 +97,71 @@ template <typename T> Ensemble<T>::~Ensemble() {
 template <typename T>
 void Ensemble<T>::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) {
     Log(CERR) << "Training ensemble of " << args.ensemble << " models ...\n";
-    Log::updateGlobalIndent(2);
-    for (int i = 0; i < args.ensemble; ++i) {
-        Log(CERR) << "Training ensemble " << i << " ...\n";
+
+    // Labels' features used for building k-means trees are the same for all the members
+    SRMatrix labelsFeatures;
+    SRMatrix* sharedLabelsFeatures = nullptr;
+    if (args.treeType == hierarchicalKmeans && args.treeStructure.empty()) {
+        Log(CERR) << "Computing labels' features matrix ...\n";
+        computeLabelsFeaturesMatrix(labelsFeatures, labels, features, args.threads, args.norm,
+                                    args.kmeansWeightedFeatures);
+        sharedLabelsFeatures = &labelsFeatures;
+    }
+
+    int concurrentMembers = std::min(args.ensParallel, args.ensemble);
+    if (concurrentMembers > 1) {
+        // Each member gets its share of threads and its own seed, drawn upfront to keep the results deterministic
+        std::vector<Args> membersArgs(args.ensemble, args);
+        for (auto& memberArgs : membersArgs) {
+            memberArgs.threads = std::max(1, args.threads / concurrentMembers);
+            memberArgs.setSeed(args.getSeed());
+        }
+
+        Log(CERR) << "Training " << concurrentMembers << " members concurrently, in "
+                  << membersArgs[0].threads << " threads each ...\n";
+        bool progress = Log::getProgress();
+        Log::setProgress(false); // Progress of concurrent members would be interleaved
+        std::atomic<int> nextMember(0);
+        TaskSet tSet(concurrentMembers);
+        for (int t = 0; t < concurrentMembers; ++t)
+            tSet.add(trainMembersThread, std::ref(labels), std::ref(features), std::ref(membersArgs), output,
+                     sharedLabelsFeatures, std::ref(nextMember));
+        tSet.joinAll();
+        Log::setProgress(progress);
+    } else {
         Log::updateGlobalIndent(2);
-        std::string memberDir = joinPath(output, "member_" + std::to_string(i));
-        makeDir(memberDir);
-        T* member = new T();
-        member->train(labels, features, args, memberDir);
-        delete member;
+        for (int i = 0; i < args.ensemble; ++i) {
+            Log(CERR) << "Training ensemble " << i << " ...\n";
+            Log::updateGlobalIndent(2);
+            trainMember(labels, features, args, output, i, sharedLabelsFeatures);
+            Log::updateGlobalIndent(-2);
+        }
         Log::updateGlobalIndent(-2);
     }
-    Log::updateGlobalIndent(-2);
+}
+
+template <typename T>
+void Ensemble<T>::trainMember(SRMatrix& labels, SRMatrix& features, Args& args, const std::string& output, int memberNo,
+                              SRMatrix* labelsFeatures) {
+    std::string memberDir = joinPath(output, "member_" + std::to_string(memberNo));
+    makeDir(memberDir);
+    T* member = new T();
+    member->setLabelsFeatures(labelsFeatures);
+    member->train(labels, features, args, memberDir);
+    delete member;
+}
+
+template <typename T>
+void Ensemble<T>::trainMembersThread(SRMatrix& labels, SRMatrix& features, std::vector<Args>& membersArgs,
+                                     const std::string& output, SRMatrix* labelsFeatures, std::atomic<int>& nextMember) {
+    // Lines of members trained concurrently are interleaved, so each one is marked with the member's number
+    int i;
+    while ((i = nextMember++) < membersArgs.size()) {
+        Log::setThreadPrefix("[member " + std::to_string(i) + "] ");
+        Log(CERR) << "Training ensemble " << i << " ...\n";
+        trainMember(labels, features, membersArgs[i], output, i, labelsFeatures);
+    }
+    Log::setThreadPrefix("");
 }
 
 template <typename T>
@@ -101,6 +177,24 @@ void Ensemble<T>::accumulatePrediction(UnorderedMap<int, EnsemblePrediction>& en
     }
 }
 
+template <typename T>
+void Ensemble<T>::addMissingScores(T* member, int memberNo, UnorderedMap<int, EnsemblePrediction>& ensemblePredictions,
+                                   SparseVector& features, Args& args) {
+    // All the missing labels are scored in one call, so the member can share the work between them
+    std::vector<Label> missingLabels;
+    std::vector<EnsemblePrediction*> missingPredictions;
+    for (auto& p : ensemblePredictions) {
+        if (!std::count(p.second.members.begin(), p.second.members.end(), memberNo)) {
+            missingLabels.push_back(p.second.label);
+            missingPredictions.push_back(&p.second);
+        }
+    }
+    if (missingLabels.empty()) return;
+
+    auto values = member->predictForLabels(missingLabels, features, args);
+    for (size_t i = 0; i < values.size(); ++i) missingPredictions[i]->value += values[i];
+}
+
 template <typename T>
 void Ensemble<T>::accumulatePrediction(UnorderedMap<int, Prediction>& ensemblePredictions,
                                        std::vector<Prediction>& prediction) {
@@ -120,16 +214,11 @@ template <typename T> void Ensemble<T>::predict(std::vector<Prediction>& predict
         accumulatePrediction(ensemblePredictions, prediction, i);
     }
 
+    if (args.ensMissingScores)
+        for (size_t i = 0; i < members.size(); ++i) addMissingScores(members[i], i, ensemblePredictions, features, args);
+
     prediction.clear();
-    for (auto& p : ensemblePredictions) {
-        if(args.ensMissingScores) {
-            for (size_t i = 0; i < members.size(); ++i) {
-                if (!std::count(p.second.members.begin(), p.second.members.end(), i))
-                    p.second.value += members[i]->predictForLabel(p.second.label, features, args);
-            }
-        }
-        prediction.push_back({p.second.label, p.second.value / members.size()});
-    }
+    for (auto& p : ensemblePredictions) prediction.push_back({p.second.label, p.second.value / members.size()});
 
     sort(prediction.rbegin(), prediction.rend());
     if (args.topK > 0) prediction.resize(args.topK);
@@ -141,6 +230,62 @@ template <typename T> Real Ensemble<T>::predictForLabel(Label label, SparseVecto
     return value / members.size();
 }
 
+template <typename T>
+std::vector<Real> Ensemble<T>::predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) {
+    std::vector<Real> values(labels.size(), 0);
+    for (auto& m : members) {
+        auto mValues = m->predictForLabels(labels, features, args);
+        for (size_t i = 0; i < values.size(); ++i) values[i] += mValues[i];
+    }
+    for (auto& v : values) v /= members.size();
+    return values;
+}
+
+template <typename T>
+void Ensemble<T>::forEachMember(Args& args, const std::function<void(T*, int)>& func) {
+    if (!args.ensOnTheTrot) {
+        for (int i = 0; i < members.size(); ++i) func(members[i], i);
+        return;
+    }
+
+    // Loading of the next member overlaps with the use of the current one
+    TaskSet loader(1);
+    std::future<T*> nextMember = loader.add(&Ensemble<T>::loadMember, this, std::ref(args), args.output, 0);
+    for (int i = 0; i < args.ensemble; ++i) {
+        T* member = nextMember.get();
+        Log(CERR) << "Loaded ensemble member " << i << "\n";
+        if (i + 1 < args.ensemble)
+            nextMember = loader.add(&Ensemble<T>::loadMember, this, std::ref(args), args.output, i + 1);
+        func(member, i);
+        delete member;
+    }
+}
+
+template <typename T>
+void Ensemble<T>::predictMembersThread(std::vector<T*>& members, std::vector<std::vector<std::vector<Prediction>>>& membersPredictions,
+                                       SRMatrix& features, Args& args, std::atomic<int>& nextMember) {
+    int i;
+    while ((i = nextMember++) < members.size())
+        membersPredictions[i] = members[i]->predictBatch(features, args);
+}
+
+template <typename T>
+void Ensemble<T>::predictMissingScoresThread(T* member, int memberNo,
+                                             std::vector<UnorderedMap<int, EnsemblePrediction>>& ensemblePredictions,
+                                             SRMatrix& features, Args& args, std::atomic<int>& nextRow,
+                                             std::atomic<int>& doneRows, const int chunkRows) {
+    const int rows = features.rows();
+    int startRow;
+    while ((startRow = nextRow.fetch_add(chunkRows)) < rows) {
+        const int stopRow = std::min(startRow + chunkRows, rows);
+        for (int r = startRow; r < stopRow; ++r)
+            addMissingScores(member, memberNo, ensemblePredictions[r], features[r], args);
+
+        const int done = doneRows.fetch_add(stopRow - startRow);
+        printProgress(done, done + stopRow - startRow, rows);
+    }
+}
+
 template <typename T>
 std::vector<std::vector<Prediction>> Ensemble<T>::predictBatch(SRMatrix& features, Args& args) {
     int rows = features.rows();
@@ -150,41 +295,55 @@ std::vector<std::vector<Prediction>> Ensemble<T>::predictBatch(SRMatrix& feature
     if(args.ensMissingScores) allEnsemblePredictions.resize(rows);
     else simpleEnsemblePredictions.resize(rows);
 
-    T* tmpMember;
-
-    // Get top predictions for members
-    for (int i = 0; i < args.ensemble; ++i) {
-        if (args.ensOnTheTrot) tmpMember = loadMember(args, args.output, i);
-        else tmpMember = members[i];
-
-        std::vector<std::vector<Prediction>> memberPredictions = tmpMember->predictBatch(features, args);
+    auto accumulateMemberPredictions = [&](std::vector<std::vector<Prediction>>& memberPredictions, int memberNo) {
         if(args.ensMissingScores)
-            for (int j = 0; j < rows; ++j) accumulatePrediction(allEnsemblePredictions[j], memberPredictions[j], i);
+            for (int j = 0; j < rows; ++j) accumulatePrediction(allEnsemblePredictions[j], memberPredictions[j], memberNo);
         else
             for (int j = 0; j < rows; ++j) accumulatePrediction(simpleEnsemblePredictions[j], memberPredictions[j]);
+    };
 
-        if (args.ensOnTheTrot) delete tmpMember;
+    // Get top predictions for members
+    if (args.ensOnTheTrot) {
+        forEachMember(args, [&](T* member, int i) {
+            std::vector<std::vector<Prediction>> memberPredictions = member->predictBatch(features, args);
+            accumulateMemberPredictions(memberPredictions, i);
+        });
+    } else {
+        // All members are already in memory, so they predict concurrently, each one with its share of threads
+        int concurrentMembers = std::min<int>(members.size(), std::max(args.threads, 1));
+        Args memberArgs = args;
+        memberArgs.threads = std::max(1, args.threads / concurrentMembers);
+
+        std::vector<std::vector<std::vector<Prediction>>> membersPredictions(members.size());
+        std::atomic<int> nextMember(0);
+        TaskSet tSet(concurrentMembers);
+        for (int t = 0; t < concurrentMembers; ++t)
+            tSet.add(predictMembersThread, std::ref(members), std::ref(membersPredictions), std::ref(features),
+                     std::ref(memberArgs), std::ref(nextMember));
+        tSet.joinAll();
+
+        for (int i = 0; i < members.size(); ++i) {
+            accumulateMemberPredictions(membersPredictions[i], i);
+            membersPredictions[i].clear();
+            membersPredictions[i].shrink_to_fit();
+        }
     }
 
     std::vector<std::vector<Prediction>> predictions(rows);
 
-    // Predict missing predictions for specific labels
+    // Predict missing predictions for specific labels, rows are processed in parallel
     if(args.ensMissingScores) {
-        for (int i = 0; i < args.ensemble; ++i) {
-            if (args.ensOnTheTrot) tmpMember = loadMember(args, args.output, i);
-            else tmpMember = members[i];
-
-            for (int j = 0; j < rows; ++j) {
-                printProgress(j, rows);
-                for (auto &p : allEnsemblePredictions[j]) {
-                    if (!std::count(p.second.members.begin(), p.second.members.end(), i))
-                        p.second.value += tmpMember->predictForLabel(p.second.label, features[j], args);
-                }
-            }
-
-            tmpMember->unload();
-            if (args.ensOnTheTrot) delete tmpMember;
-        }
+        Log(CERR) << "Predicting missing scores in " << args.threads << " threads ...\n";
+        const int chunkRows = std::max(1, std::min(256, rows / (args.threads * 16)));
+        forEachMember(args, [&](T* member, int i) {
+            std::atomic<int> nextRow(0);
+            std::atomic<int> doneRows(0);
+            TaskSet tSet(args.threads);
+            for (int t = 0; t < args.threads; ++t)
+                tSet.add(predictMissingScoresThread, member, i, std::ref(allEnsemblePredictions), std::ref(features),
+                         std::ref(args), std::ref(nextRow), std::ref(doneRows), chunkRows);
+            tSet.joinAll();
+        });
 
         for (int i = 0; i < rows; ++i) {
             predictions[i].reserve(allEnsemblePredictions[i].size());
@@ -208,9 +367,8 @@ std::vector<std::vector<Prediction>> Ensemble<T>::predictBatch(SRMatrix& feature
     return predictions;
 }
 
+// Doesn't change the log indent, since it may run on the background loader thread, it is up to the caller
 template <typename T> T* Ensemble<T>::loadMember(Args& args, const std::string& infile, int memberNo) {
-    Log(CERR) << "Loading ensemble member " << memberNo << " ...\n";
-    Log::updateGlobalIndent(2);
     assert(memberNo < args.ensemble);
     T* member = new T();
     member->load(args, joinPath(infile, "member_" + std::to_string(memberNo)));
@@ -221,7 +379,6 @@ template <typename T> T* Ensemble<T>::loadMember(Args& args, const std::string&
     if(!labelsBiases.empty())
         member->setLabelsBiases(labelsBiases);
 
-    Log::updateGlobalIndent(-2);
     return member;
 }
 
@@ -229,18 +386,48 @@ template <typename T> void Ensemble<T>::load(Args& args, std::string infile) {
     if (!args.ensOnTheTrot) {
         Log(CERR) << "Loading ensemble of " << args.ensemble << " models ...\n";
         Log::updateGlobalIndent(2);
-        for (int i = 0; i < args.ensemble; ++i) members.push_back(loadMember(args, infile, i));
+        for (int i = 0; i < args.ensemble; ++i) {
+            Log(CERR) << "Loading ensemble member " << i << " ...\n";
+            Log::updateGlobalIndent(2);
+            members.push_back(loadMember(args, infile, i));
+            Log::updateGlobalIndent(-2);
+        }
         m = members[0]->outputSize();
         Log::updateGlobalIndent(-2);
     } else {
+        Log::updateGlobalIndent(2);
+        Log(CERR) << "Loading ensemble member 0 ...\n";
         Log::updateGlobalIndent(2);
         T* member = loadMember(args, infile, 0);
         m = member->outputSize();
         delete member;
+        Log::updateGlobalIndent(-4);
+    }
+}
+
+template <typename T>
+void Ensemble<T>::compact(Args& args, const std::string& infile, const std::string& outfile) {
+    copyModelFiles(infile, outfile, {});
+    for (int i = 0; i < args.ensemble; ++i) {
+        Log(CERR) << "Compacting ensemble member " << i << " ...\n";
+        Log::updateGlobalIndent(2);
+        std::string memberDir = "member_" + std::to_string(i);
+        T member;
+        member.compact(args, joinPath(infile, memberDir), joinPath(outfile, memberDir));
         Log::updateGlobalIndent(-2);
     }
 }
 
+template <typename T>
+void Ensemble<T>::profile(SRMatrix& features, Args& args, const std::string& infile) {
+    forEachMember(args, [&](T* member, int i) {
+        Log(CERR) << "Profiling ensemble member " << i << " ...\n";
+        Log::updateGlobalIndent(2);
+        member->profile(features, args, joinPath(infile, "member_" + std::to_string(i)));
+        Log::updateGlobalIndent(-2);
+    });
+}
+
 template <typename T> void Ensemble<T>::printInfo() {}
 
 template <typename T> void Ensemble<T>::setLabelsWeights(std::vector<Real> lw){
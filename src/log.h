@@ -46,12 +46,15 @@ public:
     static inline bool logTime = false;
     static inline bool logLabel = false;
     static inline int logIndent = 0;
+    static inline bool logProgress = true;
+    static inline thread_local std::string logPrefix; // Marks lines of the calling thread, e.g. of concurrent tasks
 
     
     Log() {}
     Log(LogLevel level, int indent = 0, bool time = false, bool label = false): level(level) {
         if(time || logTime) operator << (getTime() + " ");
         if(label || logLabel) operator << ("[" + getLabel(level) + "] : ");
+        if(!logPrefix.empty()) operator << (logPrefix);
         if((logIndent + indent) > 0) operator << (std::string(logIndent + indent, ' '));
     }
 
@@ -80,7 +83,13 @@ public:
     static void setGlobalIndent(int indent) { logIndent = indent; }
     static void updateGlobalIndent(int indent) { logIndent += indent; }
 
-    static std::string newLine(int indent = 0) { return "\n" + std::string(logIndent + indent, ' '); }
+    static bool getProgress() { return logProgress; }
+    static void setProgress(bool progress) { logProgress = progress; }
+
+    static std::string getThreadPrefix() { return logPrefix; }
+    static void setThreadPrefix(const std::string& prefix) { logPrefix = prefix; }
+
+    static std::string newLine(int indent = 0) { return "\n" + logPrefix + std::string(logIndent + indent, ' '); }
 
 private:
     bool opened = false;
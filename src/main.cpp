@@ -26,6 +26,7 @@
  Only this file should use std:cout.
  */
 
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -85,22 +86,25 @@ void train(Args& args) {
     makeDir(args.output);
     args.saveToFile(joinPath(args.output, "args.bin"));
 
-    // Create data reader and load train data
-    DataReader dataReader(args);
-    dataReader.readData(labels, features, args);
-    Log(COUT) << "Train data statistics:"
-              << Log::newLine(2) << "Train data points: " << features.rows()
-              << Log::newLine(2) << "Uniq features: " << features.cols() - 2
-              << Log::newLine(2) << "Uniq labels: " << labels.cols()
-              << Log::newLine(2) << "Labels / data point: " << static_cast<double>(labels.cells()) / labels.rows()
-              << Log::newLine(2) << "Features / data point: " << static_cast<double>(features.cells()) / features.rows() << "\n";
+    // Create data reader and load train data, in streaming mode the data is read in batches during training
+    if (!args.streamTrain) {
+        DataReader dataReader(args);
+        dataReader.readData(labels, features, args);
+        Log(COUT) << "Train data statistics:"
+                  << Log::newLine(2) << "Train data points: " << features.rows()
+                  << Log::newLine(2) << "Uniq features: " << features.cols() - 2
+                  << Log::newLine(2) << "Uniq labels: " << labels.cols()
+                  << Log::newLine(2) << "Labels / data point: " << static_cast<double>(labels.cells()) / labels.rows()
+                  << Log::newLine(2) << "Features / data point: " << static_cast<double>(features.cells()) / features.rows() << "\n";
+    }
 
     auto resAfterData = getResources();
 
     // Create and train model (train function also saves model)
     std::shared_ptr<Model> model = Model::factory(args);
     loadThWBVecs(model, args);
-    model->train(labels, features, args, args.output);
+    if (args.streamTrain) model->trainOnStream(args, args.output);
+    else model->train(labels, features, args, args.output);
     model->printInfo();
 
     auto resAfterTraining = getResources();
@@ -112,10 +116,11 @@ void train(Args& args) {
     auto cpuTime = resAfterTraining.cpuTime - resAfterData.cpuTime;
     Log(COUT) << "Train resources:"
               << Log::newLine(2) << "Train real time (s): " << realTime
-              << Log::newLine(2) << "Train CPU time (s): " << cpuTime
-              << Log::newLine(2) << "Train real time / data point (ms): " << realTime * 1000 / labels.rows()
-              << Log::newLine(2) << "Train CPU time / data point (ms): " << cpuTime * 1000 / labels.rows()
-              << Log::newLine(2) << "Train peak of real memory (MB): " << resAfterTraining.peakRealMem / 1024
+              << Log::newLine(2) << "Train CPU time (s): " << cpuTime;
+    if (!args.streamTrain)
+        Log(COUT) << Log::newLine(2) << "Train real time / data point (ms): " << realTime * 1000 / labels.rows()
+                  << Log::newLine(2) << "Train CPU time / data point (ms): " << cpuTime * 1000 / labels.rows();
+    Log(COUT) << Log::newLine(2) << "Train peak of real memory (MB): " << resAfterTraining.peakRealMem / 1024
               << Log::newLine(2) << "Train peak of virtual memory (MB): " << resAfterTraining.peakVirtualMem / 1024 << "\n";
 }
 
@@ -314,6 +319,90 @@ void ofo(Args& args) {
               << Log::newLine(2) << "Optimization CPU time (s): " << cpuTime << "\n";
 }
 
+// Predict with model from given directory, returns real time of prediction,
+// the timed pass follows an untimed warm-up one, so both compared models are measured in the same conditions
+double compactPredictionTime(std::vector<std::vector<Prediction>>& predictions, const std::string& modelDir,
+                             SRMatrix& features, Args& args) {
+    std::shared_ptr<Model> model = Model::factory(args);
+    model->load(args, modelDir);
+    model->predictBatch(features, args);
+    auto resBefore = getResources();
+    predictions = model->predictBatch(features, args);
+    auto resAfter = getResources();
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                   resAfter.timePoint - resBefore.timePoint).count()) / 1000;
+}
+
+void compact(Args& args) {
+    printLogo();
+
+    // Load model args
+    args.loadFromFile(joinPath(args.output, "args.bin"));
+    if (args.compactOutput.empty()) args.compactOutput = args.output + "_compact";
+    if (std::filesystem::weakly_canonical(args.compactOutput) == std::filesystem::weakly_canonical(args.output))
+        throw std::invalid_argument("Output directory of the compacted model has to differ from the model directory");
+    if (!args.isArgSet("--weightsThreshold")) args.weightsThreshold = 0; // Re-prune only on request
+    args.printArgs("compact");
+
+    std::shared_ptr<Model> model = Model::factory(args);
+    model->compact(args, args.output, args.compactOutput);
+
+    size_t sizeBefore = getDirSize(args.output);
+    size_t sizeAfter = getDirSize(args.compactOutput);
+    Log(COUT) << "Compaction results:"
+              << Log::newLine(2) << "Model size: " << formatMem(sizeBefore) << " -> " << formatMem(sizeAfter)
+              << Log::newLine(2) << "Model size change (%): " << 100.0 * (static_cast<double>(sizeAfter) - sizeBefore) / sizeBefore << "\n";
+
+    // Compare prediction of both models on given data
+    if (!args.input.empty()) {
+        SRMatrix labels;
+        SRMatrix features;
+        DataReader dataReader(args);
+        dataReader.readData(labels, features, args);
+
+        std::vector<std::vector<Prediction>> predictionsBefore, predictionsAfter;
+        double timeBefore = compactPredictionTime(predictionsBefore, args.output, features, args);
+        double timeAfter = compactPredictionTime(predictionsAfter, args.compactOutput, features, args);
+
+        int changed = 0;
+        for (int r = 0; r < features.rows(); ++r) {
+            if (predictionsBefore[r].size() != predictionsAfter[r].size()) ++changed;
+            else
+                for (int i = 0; i < predictionsBefore[r].size(); ++i)
+                    if (predictionsBefore[r][i].label != predictionsAfter[r][i].label) {
+                        ++changed;
+                        break;
+                    }
+        }
+
+        Log(COUT) << Log::newLine(2) << "Prediction real time (s): " << timeBefore << " -> " << timeAfter
+                  << Log::newLine(2) << "Prediction real time / data point (ms): " << timeBefore * 1000 / features.rows()
+                  << " -> " << timeAfter * 1000 / features.rows()
+                  << Log::newLine(2) << "Data points with changed predicted labels (%): "
+                  << 100.0 * changed / features.rows() << "\n";
+    }
+}
+
+void profile(Args& args) {
+    printLogo();
+
+    // Load model args
+    args.loadFromFile(joinPath(args.output, "args.bin"));
+    args.profileMemLimit = 0; // Profile the model as it was trained
+    args.printArgs("profile");
+
+    std::shared_ptr<Model> model = Model::factory(args);
+    model->load(args, args.output);
+
+    // Load data
+    SRMatrix labels;
+    SRMatrix features;
+    DataReader dataReader(args);
+    dataReader.readData(labels, features, args);
+
+    model->profile(features, args, args.output);
+}
+
 void testPredictionTime(Args& args) {
     printLogo();
 
@@ -393,6 +482,8 @@ Commands:
     train                   Train model on given input data
     test                    Test model on given input data
     predict                 Predict for given data
+    compact                 Rewrite trained model in a more compact form
+    profile                 Save how often nodes of the model are evaluated on given data
     version                 Print napkinXC version
     help                    Print help
 
@@ -401,11 +492,14 @@ Args:
     -i, --input             Input dataset, required
     -o, --output            Output (model) dir, required
     -m, --model             Model type (default = plt)
-                            Models: plt, hsm, br, ovr, oplt
+                            Models: plt, hsm, br, ovr, oplt, xt, mach
     -p, --prediction
     --ensemble              Number of models in ensemble (default = 1)
+    --ensParallel           Number of ensemble members trained concurrently, threads are split between them (default = 1)
     -t, --threads           Number of threads to use (default = 0)
                             Note: set to -1 to use a number of available CPUs - 1, 0 to use a number of available CPUs
+    --numa                  Replicate base classifiers on every NUMA node and bind prediction threads to nodes (default = 0)
+                            Note: has no effect on machines with a single NUMA node
     --memLimit              Maximum amount of memory (in G) available for training (default = 0)
                             Note: set to 0 to set limit to amount of available memory
     --hash                  Size of features space (default = 0)
@@ -439,6 +533,35 @@ Args:
     -l, --lr, --eta         Step size (learning rate) for online optimizers (default = 1.0)
     --epochs                Number of training epochs for online optimizers (default = 1)
     --adagradEps            Defines starting step size for AdaGrad (default = 0.001)
+    --l2Penalty             L2 regularization strength for online optimizers and extremeText (default = 0)
+    --l1Penalty             L1 regularization strength for online optimizers and extremeText (default = 0)
+                            Note: both are applied lazily, only to the weights of features present in an example
+    --streamTrain           Train online models (oplt and xt) on data read in batches from the input file,
+                            without loading the whole dataset into memory (default = 0)
+                            Note: batch size is set with --batchRows (default = 10000)
+    --streamCache           Cache the data stream in binary format for epochs after the first one (default = 0)
+    --hogwild               Update base classifiers of oplt without locking, races between threads are tolerated (default = 0)
+                            Note: weights are preallocated as dense vectors of features space size, use --hash to limit it
+    --miniBatch             Accumulate gradients of oplt base classifiers over this many examples in each thread
+                            and apply them in one merged update (default = 1)
+    --snapshotInterval      Publish a read-only snapshot of oplt for prediction during training every given number
+                            of seconds, 0 publishes it on demand, when the model was updated since the last one
+                            (default = 0)
+    --checkpointInterval    Write checkpoint of oplt every given number of seconds during training, only nodes changed
+                            since the previous one are written, checkpoints are replayed by --resume (default = 0)
+
+    extremeText:
+    --dims                  Dimension of input (word) and tree node vectors (default = 100)
+    --quantize              Quantize input vectors to 8-bit integers with a scale per vector after training,
+                            they are decoded on the fly during prediction, when used with test or predict command
+                            on not quantized model, the loaded input vectors are quantized in memory (default = 0)
+    --quantizeOutput        Also store tree node vectors quantized, they are decoded while loading (default = 0)
+
+    MACH:
+    --machHashes            Number of hashes (default = 10)
+    --machBuckets           Number of buckets per hash (default = 100)
+    --machTopBuckets        Predict only for labels from given number of top scored buckets of each hash,
+                            0 scores all labels (default = 5)
 
     Tree (PLT and HSM):
     -a, --arity             Arity of tree nodes (default = 2)
@@ -458,8 +581,20 @@ Args:
     --threshold             Predict labels with probability above the threshold (default = 0)
     --thresholds            Path to a file with threshold for each label, one threshold per line
     --labelsWeights         Path to a file with weight for each label, one weight per line
+    --nodeCache             Size (in entries) of the cache of tree nodes' probabilities for examples scored repeatedly,
+                            e.g. by ofo epochs or ensemble missing scores, 0 disables it (default = 0)
+                            Note: used by plt and oplt with exact tree search
+    --profileMemLimit       Memory limit (in G) for base classifiers of model with nodes profile (created by profile command),
+                            most evaluated nodes get dense weights within the limit, never evaluated get sparse ones,
+                            0 disables it (default = 0)
+                            Note: used by plt and hsm
     --predictionPrecision   Number of decimal digits to output for predictions (default = 5)
 
+    Compact:
+    --compactOutput         Output directory for the compacted model (default = model dir + "_compact")
+    --weightsThreshold      If given, weights of the model are pruned again with this threshold
+                            Note: with --input, prediction time and predicted labels of both models are compared
+
     Test:
     --metrics               Evaluate test using set of metrics (default = "p@1,p@3,p@5")
                             Measures: acc (accuracy), p (precision), r (recall), c (coverage), hl (hamming loos)
@@ -500,6 +635,10 @@ int main(int argc, char** argv) {
         test(args);
     else if (command == "predict")
         predict(args);
+    else if (command == "compact")
+        compact(args);
+    else if (command == "profile")
+        profile(args);
 
     // These commands are for experiments and are not included in the help
     else if (command == "ofo")
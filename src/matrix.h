@@ -22,6 +22,12 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
 #include "vector.h"
 
 // Simple row ordered matrix
@@ -85,3 +91,66 @@ private:
 typedef RMatrix<Vector> Matrix;
 typedef RMatrix<MapVector> MRMatrix;
 typedef RMatrix<SparseVector> SRMatrix;
+
+// Dense row ordered matrix with rows quantized to 8-bit integers, each row has its own scale,
+// value of a cell is scale * quantized value, rows are decoded on the fly when used
+class QMatrix {
+public:
+    QMatrix(): m(0), n(0) {}
+
+    void quantize(Matrix& matrix) {
+        m = matrix.rows();
+        n = matrix.cols();
+        scales.resize(m);
+        values.resize(m * n);
+        for (size_t i = 0; i < m; ++i) {
+            Real* row = matrix[i].data();
+            Real maxAbs = 0;
+            for (size_t j = 0; j < n; ++j) maxAbs = std::max(maxAbs, std::fabs(row[j]));
+            scales[i] = maxAbs / 127;
+            int8_t* qRow = values.data() + i * n;
+            for (size_t j = 0; j < n; ++j)
+                qRow[j] = maxAbs > 0 ? static_cast<int8_t>(std::lround(row[j] / scales[i])) : 0;
+        }
+    }
+
+    // Decodes whole matrix back to the real values
+    Matrix dequantize() const {
+        Matrix matrix(m, n);
+        for (size_t i = 0; i < m; ++i) addRow(i, 1.0, matrix[i].data());
+        return matrix;
+    }
+
+    // v += row * scalar
+    inline void addRow(int index, Real scalar, Real* v) const {
+        const Real s = scales[index] * scalar;
+        const int8_t* qRow = values.data() + index * n;
+        for (size_t j = 0; j < n; ++j) v[j] += s * qRow[j];
+    }
+
+    inline int rows() const { return m; }
+    inline int cols() const { return n; }
+    inline unsigned long long mem() const { return scales.size() * sizeof(Real) + values.size() * sizeof(int8_t); }
+
+    void save(std::ofstream& out) {
+        out.write((char*)&m, sizeof(m));
+        out.write((char*)&n, sizeof(n));
+        out.write((char*)scales.data(), m * sizeof(Real));
+        out.write((char*)values.data(), m * n * sizeof(int8_t));
+    }
+
+    void load(std::ifstream& in) {
+        in.read((char*)&m, sizeof(m));
+        in.read((char*)&n, sizeof(n));
+        scales.resize(m);
+        values.resize(m * n);
+        in.read((char*)scales.data(), m * sizeof(Real));
+        in.read((char*)values.data(), m * n * sizeof(int8_t));
+    }
+
+private:
+    size_t m;                   // Row count
+    size_t n;                   // Col count
+    std::vector<Real> scales;   // Scale of each row
+    std::vector<int8_t> values; // Quantized rows data
+};
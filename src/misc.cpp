@@ -87,7 +87,7 @@ void computeLabelsFeaturesMatrix(SRMatrix& labelsFeatures, const SRMatrix& label
         for(auto &l : labels[i]) labelsExamples[l.index].push_back(i);
 
     std::vector<std::vector<Feature>> tmpLabelsFeatures(labels.cols());
-    ThreadSet tSet;
+    TaskSet tSet(threads);
     for (int t = 0; t < threads; ++t)
         tSet.add(computeLabelsFeaturesMatrixThread, std::ref(tmpLabelsFeatures), std::ref(labelsExamples),
                  std::ref(labels), std::ref(features), norm, weightedFeatures, t, threads);
@@ -190,6 +190,19 @@ void makeDir(const std::string& dirname) {
     if(!std::filesystem::exists(dirname)) std::filesystem::create_directories(dirname);
 }
 
+// Remove file or directory
+void remove(const std::string& path) {
+    std::filesystem::remove_all(path);
+}
+
+// Size of all files in directory and its subdirectories
+size_t getDirSize(const std::string& path) {
+    size_t size = 0;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(path))
+        if (entry.is_regular_file()) size += entry.file_size();
+    return size;
+}
+
 // Save/load vector of numbers
 std::vector<Real> loadVec(std::string infile){
     std::vector<Real> vec;
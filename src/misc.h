@@ -64,7 +64,14 @@ template <typename T> inline uint32_t hash(T& v) {
 
 // Prints progress
 inline void printProgress(int state, int max) {
-    if (max < 100 || state % (max / 100) == 0)
+    if (Log::getProgress() && (max < 100 || state % (max / 100) == 0))
+        Log(CERR) << "  " << std::round(static_cast<Real>(state) / (static_cast<Real>(max) / 100)) << "%\r";
+}
+
+// Prints progress if a full percent was crossed between prevState and state,
+// for progress of many threads counted with a shared counter
+inline void printProgress(int prevState, int state, int max) {
+    if (Log::getProgress() && (max < 100 || prevState / (max / 100) != state / (max / 100)))
         Log(CERR) << "  " << std::round(static_cast<Real>(state) / (static_cast<Real>(max) / 100)) << "%\r";
 }
 
@@ -95,6 +102,9 @@ void makeDir(const std::string& dirname);
 // Remove file or directory
 void remove(const std::string& path);
 
+// Size of all files in directory and its subdirectories
+size_t getDirSize(const std::string& path);
+
 // Save/load vector of numbers
 std::vector<Real> loadVec(std::string infile);
 
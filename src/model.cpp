@@ -20,7 +20,10 @@
  SOFTWARE.
  */
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <mutex>
 #include <string>
@@ -33,6 +36,7 @@
 
 #include "br.h"
 #include "hsm.h"
+#include "mach.h"
 #include "ovr.h"
 #include "plt.h"
 #include "online_plt.h"
@@ -57,6 +61,7 @@ std::shared_ptr<Model> Model::factory(Args& args) {
         case plt: model = std::static_pointer_cast<Model>(std::make_shared<BatchPLT>()); break;
         case extremeText: model = std::static_pointer_cast<Model>(std::make_shared<ExtremeText>()); break;
         case oplt: model = std::static_pointer_cast<Model>(std::make_shared<OnlinePLT>()); break;
+        case mach: model = std::static_pointer_cast<Model>(std::make_shared<MACH>()); break;
         default: throw std::invalid_argument("Unknown model type");
         }
     }
@@ -67,16 +72,27 @@ std::shared_ptr<Model> Model::factory(Args& args) {
 Model::Model():preloaded(false), loaded(false), m(0), f(0) {}
 
 Model::~Model() {
+    clearBasesReplicas();
     unload();
 }
 
-void Model::predictBatchThread(int threadId, Model* model, std::vector<std::vector<Prediction>>& predictions,
-                               SRMatrix& features, Args& args, const int startRow, const int stopRow) {
-    const int batchSize = stopRow - startRow;
-    for (int r = startRow; r < stopRow; ++r) {
-        int i = r - startRow;
-        model->predict(predictions[r], features[r], args);
-        if (!threadId) printProgress(i, batchSize);
+void Model::trainOnStream(Args& args, std::string output) {
+    throw std::invalid_argument("Streaming training is not supported by " + name + " model");
+}
+
+void Model::predictBatchThread(Model* model, std::vector<std::vector<Prediction>>& predictions, SRMatrix& features,
+                               Args& args, std::atomic<int>& nextRow, std::atomic<int>& doneRows, const int chunkRows,
+                               const int numaNode) {
+    NumaBind numaBind(numaNode); // Pins the thread and selects the local replica of bases
+    const int rows = features.rows();
+    int startRow;
+    while ((startRow = nextRow.fetch_add(chunkRows)) < rows) {
+        const int stopRow = std::min(startRow + chunkRows, rows);
+        for (int r = startRow; r < stopRow; ++r)
+            model->predict(predictions[r], features[r], args);
+
+        const int done = doneRows.fetch_add(stopRow - startRow);
+        printProgress(done, done + stopRow - startRow, rows);
     }
 }
 
@@ -86,17 +102,29 @@ std::vector<std::vector<Prediction>> Model::predictBatch(SRMatrix& features, Arg
     int rows = features.rows();
     std::vector<std::vector<Prediction>> predictions(rows);
 
-    // Run prediction in parallel using thread set
-    ThreadSet tSet;
-    int tRows = ceil(static_cast<Real>(rows) / args.threads);
+    // Threads take small chunks of rows until all rows are processed,
+    // so threads that got cheaper examples do not wait for the others
+    const int chunkRows = std::max(1, std::min(256, rows / (args.threads * 16)));
+    std::atomic<int> nextRow(0);
+    std::atomic<int> doneRows(0);
+
+    // Run prediction in parallel using worker pool
+    TaskSet tSet(args.threads);
     for (int t = 0; t < args.threads; ++t)
-        tSet.add(predictBatchThread, t, this, std::ref(predictions), std::ref(features), std::ref(args), t * tRows,
-                 std::min((t + 1) * tRows, rows));
+        tSet.add(predictBatchThread, this, std::ref(predictions), std::ref(features), std::ref(args),
+                 std::ref(nextRow), std::ref(doneRows), chunkRows, args.numa ? t : -1);
     tSet.joinAll();
 
     return predictions;
 }
 
+std::vector<Real> Model::predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) {
+    std::vector<Real> values;
+    values.reserve(labels.size());
+    for (const auto& l : labels) values.push_back(predictForLabel(l, features, args));
+    return values;
+}
+
 void Model::setThresholds(std::vector<Real> th){
 //    if(th.size() != m)
 //        throw std::invalid_argument("Size of thresholds vector does not match number of model outputs");
@@ -112,14 +140,14 @@ void Model::setLabelsWeights(std::vector<Real> lw){
 //    if(lw.size() != m)
 //        throw std::invalid_argument("Size of labels' weights vector dose not match number of model outputs");
     labelsWeights = std::move(lw);
-    if(labelsBiases.empty()) labelsBiases = std::vector<Real>(lw.size(), 0);
+    if(labelsBiases.empty()) labelsBiases = std::vector<Real>(labelsWeights.size(), 0);
 }
 
 void Model::setLabelsBiases(std::vector<Real> lb){
 //    if(lw.size() != m)
 //        throw std::invalid_argument("Size of labels' biases vector dose not match number of model outputs");
     labelsBiases = std::move(lb);
-    if(labelsWeights.empty()) labelsWeights = std::vector<Real>(lb.size(), 0);
+    if(labelsWeights.empty()) labelsWeights = std::vector<Real>(labelsBiases.size(), 0);
 }
 
 Real Model::microOfo(SRMatrix& features, SRMatrix& labels, Args& args){
@@ -128,27 +156,12 @@ Real Model::microOfo(SRMatrix& features, SRMatrix& labels, Args& args){
 
     Log(CERR) << "Optimizing Micro F measure for " << args.epochs << " epochs using " << args.threads << " threads ...\n";
 
-    const int examples = features.rows() * args.epochs;
-    for (int i = 0; i < examples; ++i) {
-        printProgress(i, examples);
-        int r = i % features.rows();
-
-        // Predict with current thresholds
-        std::vector<Prediction> prediction;
-        args.threshold = a / b;
-        predict(prediction, features[r], args);
-
-        // Update a and b counters
-        for (const auto &p : prediction) {
-            for (int l = -1; labels[r][l] > -1; ++l)
-                if (p.label == labels[r][l]) {
-                    a++;
-                    break;
-                }
-        }
-
-        b += prediction.size() + labels.size(r);
-    }
+    ofoRounds(features, labels, args, false,
+              [&](Args& roundArgs) { roundArgs.threshold = a / b; },
+              [&](OFOCounts& counts) {
+                  a += counts.a;
+                  b += counts.b;
+              });
 
     return a / b;
 }
@@ -157,68 +170,90 @@ std::vector<Real> Model::macroOfo(SRMatrix& features, SRMatrix& labels, Args& ar
     // Variables required for OFO
     std::vector<Real> as(m, args.ofoA);
     std::vector<Real> bs(m, args.ofoB);
-    thresholds = std::vector<Real>(m, args.ofoA / args.ofoB);
 
     Log(CERR) << "Optimizing Macro F measure for " << args.epochs << " epochs using " << args.threads
               << " threads ...\n";
 
     // Set initial thresholds
-    setThresholds(thresholds);
-
-    ThreadSet tSet;
-    int tRows = ceil(static_cast<Real>(features.rows()) / args.threads);
-    for (int t = 0; t < args.threads; ++t)
-        tSet.add(macroOfoThread, t, this, std::ref(as), std::ref(bs), std::ref(features), std::ref(labels),
-                 std::ref(args),
-                 t * tRows, std::min((t + 1) * tRows, features.rows()));
-    tSet.joinAll();
+    setThresholds(std::vector<Real>(m, args.ofoA / args.ofoB));
+
+    // Update thresholds, only those that may have changed due to update of as or bs
+    UnorderedMap<int, Real> thresholdsToUpdate;
+    ofoRounds(features, labels, args, true,
+              [&](Args& roundArgs) {
+                  if (!thresholdsToUpdate.empty()) updateThresholds(thresholdsToUpdate);
+                  thresholdsToUpdate.clear();
+              },
+              [&](OFOCounts& counts) {
+                  for (const auto& l : counts.labelsAB) {
+                      as[l.first] += l.second.first;
+                      bs[l.first] += l.second.second;
+                      thresholdsToUpdate[l.first] = as[l.first] / bs[l.first];
+                  }
+              });
+    if (!thresholdsToUpdate.empty()) updateThresholds(thresholdsToUpdate);
 
     return thresholds;
 }
 
-void Model::macroOfoThread(int threadId, Model* model, std::vector<Real>& as, std::vector<Real>& bs,
-                      SRMatrix& features, SRMatrix& labels, Args& args, const int startRow, const int stopRow) {
+void Model::ofoRounds(SRMatrix& features, SRMatrix& labels, Args& args, bool macro,
+                      const std::function<void(Args&)>& prepareRound, const std::function<void(OFOCounts&)>& mergeCounts){
+    const int examples = features.rows() * args.epochs;
+    const int threads = std::max(args.threads, 1);
+    Args roundArgs = args;
+
+    TaskSet tSet(threads);
+    std::vector<OFOCounts> threadsCounts(threads);
+    for (int roundStart = 0; roundStart < examples; roundStart += args.ofoSyncInterval) {
+        printProgress(roundStart, examples);
+        const int roundStop = std::min(roundStart + args.ofoSyncInterval, examples);
+        const int tExamples = ceil(static_cast<Real>(roundStop - roundStart) / threads);
+
+        prepareRound(roundArgs);
+        for (int t = 0; t < threads; ++t) {
+            const int startExample = roundStart + t * tExamples;
+            const int stopExample = std::min(startExample + tExamples, roundStop);
+            if (startExample >= stopExample) break;
+            threadsCounts[t] = OFOCounts();
+            tSet.add(ofoThread, this, std::ref(threadsCounts[t]), std::ref(features), std::ref(labels),
+                     std::ref(roundArgs), macro, startExample, stopExample);
+        }
+        tSet.joinAll();
 
-    const int rowsRange = stopRow - startRow;
-    const int examples = rowsRange * args.epochs;
+        // Merged in the same order every time, so the result is reproducible
+        for (int t = 0; t < threads && roundStart + t * tExamples < roundStop; ++t) mergeCounts(threadsCounts[t]);
+    }
+}
 
-    for (int i = 0; i < examples; ++i) {
-        if (!threadId) printProgress(i, examples);
-        int r = startRow + i % rowsRange;
+void Model::ofoThread(Model* model, OFOCounts& counts, SRMatrix& features, SRMatrix& labels, Args& args, bool macro,
+                      const int startExample, const int stopExample) {
+    std::vector<Prediction> prediction;
+    for (int i = startExample; i < stopExample; ++i) {
+        int r = i % features.rows();
+        const auto& rLabels = labels[r];
 
         // Predict with current thresholds
-        std::vector<Prediction> prediction;
+        prediction.clear();
         model->predict(prediction, features[r], args);
 
-        // Update a and b counters
         for (const auto& p : prediction) {
-            // b[j] =  sum_{i = 1}^{t} \hat y_j + ..
-            bs[p.label]++;
-
-            // a[j] = sum_{i = 1}^{t} y_j \hat y_j
-            int l = -1;
-            while (labels[r][++l] > -1)
-                if (p.label == labels[r][l]) {
-                    as[p.label]++;
-                    break;
-                }
+            bool positive = std::any_of(rLabels.begin(), rLabels.end(), [&](const IRVPair& l) { return l.index == p.label; });
+
+            // a[j] = sum_{i = 1}^{t} y_j \hat y_j, b[j] =  sum_{i = 1}^{t} \hat y_j + ..
+            if (macro) {
+                auto& ab = counts.labelsAB[p.label];
+                if (positive) ab.first++;
+                ab.second++;
+            } else if (positive)
+                counts.a++;
         }
 
         // b[j] =  .. + sum_{i = 1}^{t} y_j
-        int l = -1;
-        while (labels[r][++l] > -1)
-            if(labels[r][l] < bs.size()) bs[labels[r][l]]++;
-
-        // Update thresholds, only those that may have changed due to update of as or bs,
-        // For simplicity I compute some of them twice because it does not really matter
-        UnorderedMap<int, Real> thresholdsToUpdate;
-        for (const auto& p : prediction)
-            thresholdsToUpdate[p.label] = as[p.label] / bs[p.label];
-        l = -1;
-        while (labels[r][++l] > -1)
-            if(labels[r][l] < bs.size()) thresholdsToUpdate[labels[r][l]] = as[labels[r][l]] / bs[labels[r][l]];
-
-        model->updateThresholds(thresholdsToUpdate);
+        if (macro) {
+            for (const auto& l : rLabels)
+                if (l.index < model->m) counts.labelsAB[l.index].second++;
+        } else
+            counts.b += prediction.size() + rLabels.nonZero();
     }
 }
 
@@ -244,7 +279,7 @@ std::vector<Real> Model::ofo(SRMatrix& features, SRMatrix& labels, Args& args) {
         std::sort(priors.rbegin(), priors.rend());
 
         thresholds = std::vector<Real>(m, microThr);
-        for(int i = 0; i < args.ofoTopLabels; ++i)
+        for(int i = 0; i < std::min<size_t>(args.ofoTopLabels, priors.size()); ++i)
             thresholds[priors[i].label] = macroThr[priors[i].label];
     }
 
@@ -288,24 +323,14 @@ void Model::trainBases(std::ofstream& out, std::vector<ProblemData>& problemsDat
 
     // Run learning in parallel
     if(args.threads > 1) {
-        // Thread set solution
-        ThreadSet tSet;
+        // Tasks run on the process-wide worker pool
+        TaskSet tSet(args.threads);
         std::vector<std::promise<Base *>> resultsPromise(size);
         std::vector<std::future<Base *>> results(size);
         for(int i = 0; i < size; ++i) results[i] = resultsPromise[i].get_future();
         for (int t = 0; t < args.threads; ++t)
             tSet.add(trainBatchThread, std::ref(resultsPromise), std::ref(problemsData), args, t, args.threads);
 
-        // Thread pool solution is slower
-        /*
-        ThreadPool tPool(args.threads);
-        std::vector<std::future<Base *>> results;
-        results.reserve(size);
-        for (int i = 0; i < size; ++i)
-            results.emplace_back(tPool.enqueue(trainBase, n, std::ref(baseLabels[i]), std::ref(baseFeatures[i]),
-                                               (instancesWeights != nullptr) ? (*instancesWeights)[i] : nullptr, args));
-        */
-
         // Saving in the main thread
         saveResults(out, results, args.saveGrads);
         tSet.joinAll();
@@ -324,8 +349,8 @@ void Model::trainBases(std::ofstream& out, std::vector<ProblemData>& problemsDat
         Real weightsSum = 0;
         for(const auto &pd : problemsData){
             meanLoss += pd.loss;
-            weightLoss += pd.loss * pd.binLabels.size();
-            weightsSum += pd.binLabels.size();
+            weightLoss += pd.loss * pd.size();
+            weightsSum += pd.size();
         }
         meanLoss /= problemsData.size();
         weightLoss /= weightsSum;
@@ -365,3 +390,83 @@ std::vector<Base*> Model::loadBases(const std::string& infile, bool resume, Repr
 
     return bases;
 }
+
+void Model::saveBases(const std::string& outfile, std::vector<Base*>& bases) {
+    Log(CERR) << "Saving base estimators ...\n";
+
+    std::ofstream out(outfile, std::ios::out | std::ios::binary);
+    int size = bases.size();
+    out.write((char*)&size, sizeof(size));
+    for (int i = 0; i < size; ++i) {
+        printProgress(i, size);
+        bases[i]->save(out);
+    }
+    out.close();
+}
+
+void Model::compactBases(std::vector<Base*>& bases, Args& args) {
+    Log(CERR) << "Compacting base estimators ...\n";
+
+    int dummy = 0;
+    unsigned long long nonZeroBefore = 0, nonZeroAfter = 0;
+    for (int i = 0; i < bases.size(); ++i) {
+        printProgress(i, bases.size());
+        if (bases[i]->getW() != nullptr) nonZeroBefore += bases[i]->getW()->nonZero();
+        bases[i]->compact(args.weightsThreshold);
+        if (bases[i]->getW() != nullptr) nonZeroAfter += bases[i]->getW()->nonZero();
+        if (bases[i]->isDummy()) ++dummy;
+    }
+
+    Log(CERR) << "Non-zero weights: " << nonZeroBefore << " -> " << nonZeroAfter << ", dummy classifiers: " << dummy << "\n";
+}
+
+void Model::copyModelFiles(const std::string& infile, const std::string& outfile, const std::vector<std::string>& skip) {
+    makeDir(outfile);
+    for (const auto& entry : std::filesystem::directory_iterator(infile)) {
+        std::string name = entry.path().filename().string();
+        if (!entry.is_regular_file() || std::count(skip.begin(), skip.end(), name)) continue;
+        std::filesystem::copy_file(entry.path(), joinPath(outfile, name), std::filesystem::copy_options::overwrite_existing);
+    }
+}
+
+void Model::compact(Args& args, const std::string& infile, const std::string& outfile) {
+    std::string weightsFile = joinPath(infile, "weights.bin");
+    if (!std::filesystem::exists(weightsFile))
+        throw std::invalid_argument("Compaction is not supported by " + name + " model");
+
+    copyModelFiles(infile, outfile, {"weights.bin"});
+    auto bases = loadBases(weightsFile);
+    compactBases(bases, args);
+    saveBases(joinPath(outfile, "weights.bin"), bases);
+    for (auto b : bases) delete b;
+}
+
+void Model::profile(SRMatrix& features, Args& args, const std::string& infile) {
+    throw std::invalid_argument("Profiling is not supported by " + name + " model");
+}
+
+void Model::replicateBasesThread(std::vector<Base*>& replica, std::vector<Base*>& bases, const int numaNode) {
+    NumaBind numaBind(numaNode); // Copies are first touched, so allocated, on the node
+    replica.reserve(bases.size());
+    for (auto b : bases) replica.push_back(b->copy());
+}
+
+void Model::replicateBases(std::vector<Base*>& bases, Args& args) {
+    clearBasesReplicas();
+
+    int nodes = NumaBind::numaNodes();
+    if (!args.numa || nodes < 2) return;
+
+    Log(CERR) << "Replicating base estimators on " << nodes << " NUMA nodes ...\n";
+    basesReplicas.resize(nodes);
+    TaskSet tSet(nodes - 1);
+    for (int n = 1; n < nodes; ++n)
+        tSet.add(replicateBasesThread, std::ref(basesReplicas[n]), std::ref(bases), n);
+    tSet.joinAll();
+}
+
+void Model::clearBasesReplicas() {
+    for (auto& replica : basesReplicas)
+        for (auto b : replica) delete b;
+    basesReplicas.clear();
+}
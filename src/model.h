@@ -23,14 +23,25 @@
 
 #pragma once
 
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <string>
+#include <utility>
 
 #include "args.h"
 #include "base.h"
 #include "basic_types.h"
 #include "misc.h"
+#include "resources.h"
+
+// Changes of OFO counters gathered by one thread during a round
+struct OFOCounts {
+    Real a = 0; // For micro F measure
+    Real b = 0;
+    UnorderedMap<int, std::pair<Real, Real>> labelsAB; // For macro F measure, label -> (a, b)
+};
 
 class Model {
 public:
@@ -40,8 +51,10 @@ public:
     virtual ~Model();
 
     virtual void train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) = 0;
+    virtual void trainOnStream(Args& args, std::string output); // Out-of-core training on args.input
     virtual void predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) = 0;
     virtual Real predictForLabel(Label label, SparseVector& features, Args& args) = 0;
+    virtual std::vector<Real> predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args);
     virtual std::vector<std::vector<Prediction>> predictBatch(SRMatrix& features, Args& args);
 
     // Prediction with thresholds and ofo
@@ -63,10 +76,18 @@ public:
     virtual void unload() { preloaded = false; loaded = false; };
     bool isPreloaded() { return preloaded; };
     bool isLoaded() { return loaded; };
+    virtual bool isTraining() { return false; }; // True if the model can be used for prediction while it is trained
 
     virtual void printInfo() {}
     inline int outputSize() { return m; };
 
+    // Rewrite model from infile directory to outfile directory in a more compact form, weights are re-pruned
+    // if args.weightsThreshold > 0
+    virtual void compact(Args& args, const std::string& infile, const std::string& outfile);
+
+    // Predict for sample of data and save how often each base classifier is evaluated to the loaded model directory
+    virtual void profile(SRMatrix& features, Args& args, const std::string& infile);
+
 protected:
     ModelType type;
     std::string name;
@@ -86,12 +107,32 @@ protected:
 
     static void saveResults(std::ofstream& out, std::vector<std::future<Base*>>& results, bool saveGrads=false);
     static std::vector<Base*> loadBases(const std::string& infile, bool resume=false, RepresentationType loadAs=map);
+    static void saveBases(const std::string& outfile, std::vector<Base*>& bases);
+
+    // Compaction utils
+    static void compactBases(std::vector<Base*>& bases, Args& args);
+    static void copyModelFiles(const std::string& infile, const std::string& outfile, const std::vector<std::string>& skip);
+
+    // NUMA mode, copies of base classifiers for each node (except node 0 that uses the original ones)
+    std::vector<std::vector<Base*>> basesReplicas;
+    void replicateBases(std::vector<Base*>& bases, Args& args);
+    void clearBasesReplicas();
+    inline std::vector<Base*>& getLocalBases(std::vector<Base*>& bases){
+        if (basesReplicas.empty()) return bases;
+        int node = NumaBind::currentNode();
+        return (node > 0) ? basesReplicas[node] : bases;
+    }
 
 private:
-    static void predictBatchThread(int threadId, Model* model, std::vector<std::vector<Prediction>>& predictions,
-                                   SRMatrix& features, Args& args, const int startRow, const int stopRow);
-
-    static void macroOfoThread(int threadId, Model* model, std::vector<Real>& as, std::vector<Real>& bs,
-                               SRMatrix& features, SRMatrix& labels, Args& args,
-                               const int startRow, const int stopRow);
+    static void predictBatchThread(Model* model, std::vector<std::vector<Prediction>>& predictions, SRMatrix& features,
+                                   Args& args, std::atomic<int>& nextRow, std::atomic<int>& doneRows, const int chunkRows,
+                                   const int numaNode);
+    static void replicateBasesThread(std::vector<Base*>& replica, std::vector<Base*>& bases, const int numaNode);
+
+    // Bulk-synchronous OFO, examples are processed in rounds with the thresholds fixed during the round,
+    // counters gathered by the threads are merged after each round, so the result does not depend on the threads
+    void ofoRounds(SRMatrix& features, SRMatrix& labels, Args& args, bool macro,
+                   const std::function<void(Args&)>& prepareRound, const std::function<void(OFOCounts&)>& mergeCounts);
+    static void ofoThread(Model* model, OFOCounts& counts, SRMatrix& features, SRMatrix& labels, Args& args, bool macro,
+                          const int startExample, const int stopExample);
 };
@@ -37,24 +37,24 @@ BR::BR() {
 }
 
 void BR::unload() {
+    clearBasesReplicas();
     for (auto b : bases) delete b;
     bases.clear();
     bases.shrink_to_fit();
 }
 
-void BR::assignDataPoints(std::vector<std::vector<Real>>& binLabels, std::vector<Feature*>& binFeatures, std::vector<Real>& binWeights,
+void BR::assignDataPoints(std::vector<std::vector<int>>& binPositives, std::vector<Feature*>& binFeatures, std::vector<Real>& binWeights,
                           SRMatrix& labels, SRMatrix& features, int rStart, int rStop, Args& args){
     int rows = labels.rows();
 
     binWeights.resize(rows, 1);
     binFeatures.resize(rows);
-    for (auto &bl: binLabels) bl.resize(rows, 0);
 
     for (int r = 0; r < rows; ++r) {
         printProgress(r, rows);
         binFeatures[r] = features[r].data();
         for (auto &l : labels[r])
-            if (l.index >= rStart && l.index < rStop) binLabels[l.index - rStart][r] = 1;
+            if (l.index >= rStart && l.index < rStop) binPositives[l.index - rStart].push_back(r);
     }
 }
 
@@ -64,7 +64,7 @@ void BR::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string out
     int range = lCols / parts + 1;
 
     assert(lCols < range * parts);
-    std::vector<std::vector<Real>> binLabels(range);
+    std::vector<std::vector<int>> binPositives(range); // Only positive rows are stored, labels are materialized lazily
     std::vector<Feature*> binFeatures;
     std::vector<Real> binWeights;
     std::vector<ProblemData> binProblemData;
@@ -82,15 +82,14 @@ void BR::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string out
         else
             Log(CERR) << "Assigning labels for base estimators ...\n";
 
-        for (auto &bl: binLabels) std::fill(bl.begin(), bl.end(), 0);
+        assignDataPoints(binPositives, binFeatures, binWeights, labels, features, rStart, rStop, args);
 
-        assignDataPoints(binLabels, binFeatures, binWeights, labels, features, rStart, rStop, args);
-
-        unsigned long long usedMem = binFeatures.size() * ((range + 1) * sizeof(Real) + sizeof(void*));
+        unsigned long long usedMem = binFeatures.size() * (sizeof(Real) + sizeof(void*)) + range * sizeof(std::vector<int>);
+        for (auto &bp: binPositives) usedMem += bp.size() * sizeof(int);
         Log(CERR) << "  Temporary data size: " << formatMem(usedMem) << "\n";
 
         // Train bases
-        for(int i = 0; i < range; ++i) binProblemData.emplace_back(binLabels[i], binFeatures, features.cols(), binWeights);
+        for(int i = 0; i < range; ++i) binProblemData.emplace_back(binPositives[i], binFeatures, features.cols(), binWeights);
 
         if(!labelsWeights.empty()) {
             Log(CERR) << "Setting inv ps weights for training ...\n";
@@ -99,7 +98,10 @@ void BR::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string out
 
         trainBases(out, binProblemData, args);
 
-        for (auto& l : binLabels) l.clear();
+        for (auto& bp : binPositives) {
+            bp.clear();
+            bp.shrink_to_fit();
+        }
         binFeatures.clear();
         binWeights.clear();
         binProblemData.clear();
@@ -135,20 +137,25 @@ void BR::predict(std::vector<Prediction>& prediction, SparseVector& features, Ar
 
 std::vector<Prediction> BR::predictForAllLabels(SparseVector& features, Args& args) {
     std::vector<Prediction> prediction;
-    prediction.reserve(bases.size());
-    for (int i = 0; i < bases.size(); ++i)
-        prediction.emplace_back(i, bases[i]->predictProbability(features));
+    auto& localBases = getLocalBases(bases);
+    prediction.reserve(localBases.size());
+    for (int i = 0; i < localBases.size(); ++i)
+        prediction.emplace_back(i, localBases[i]->predictProbability(features));
 
     return prediction;
 }
 
 Real BR::predictForLabel(Label label, SparseVector& features, Args& args) {
-    return bases[label]->predictProbability(features);
+    return getLocalBases(bases)[label]->predictProbability(features);
 }
 
 void BR::load(Args& args, std::string infile) {
     Log(CERR) << "Loading weights ...\n";
-    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
+    {
+        NumaBind numaBind(args.numa ? 0 : -1); // Original bases are placed on the first node
+        bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
+    }
+    replicateBases(bases, args);
     m = bases.size();
 
     loaded = true;
@@ -167,11 +174,12 @@ size_t BR::calculateNumberOfParts(SRMatrix& labels, SRMatrix& features, Args& ar
     // Calculate required memory
     // Size of required data
     unsigned long long dataMem = labels.mem() + features.mem();
-    unsigned long long tmpDataMem = 0;
+    unsigned long long tmpDataMem = static_cast<unsigned long long>(lCells) * sizeof(int) + lCols * sizeof(std::vector<int>);
     if(args.modelType == ovr && args.pickOneLabelWeighting)
-        tmpDataMem = lCells * ((lCols + 1) * sizeof(Real) + sizeof(void*));
-    else tmpDataMem = rows * ((lCols + 1) * sizeof(Real) + sizeof(void*));
-    unsigned long long baseMem = 4 * args.threads * features.cols() * sizeof(Real);
+        tmpDataMem += lCells * (sizeof(Real) + sizeof(void*));
+    else tmpDataMem += rows * (sizeof(Real) + sizeof(void*));
+    // Weights and labels materialized for bases trained at the moment
+    unsigned long long baseMem = args.threads * (4 * static_cast<unsigned long long>(features.cols()) + rows) * sizeof(Real);
     unsigned long long reqMem = tmpDataMem + dataMem + baseMem;
     //Log(CERR) << "Required memory to train: " << formatMem(reqMem) << ", available memory: " << formatMem(args.memLimit) << "\n";
     Log(CERR) << "Required memory to train: " << formatMem(reqMem) << " (data: " << formatMem(dataMem)
@@ -42,7 +42,7 @@ public:
 
 protected:
     std::vector<Base*> bases;
-    virtual void assignDataPoints(std::vector<std::vector<Real>>& binLabels,
+    virtual void assignDataPoints(std::vector<std::vector<int>>& binPositives,
                                   std::vector<Feature*>& binFeatures,
                                   std::vector<Real>& binWeights,
                                   SRMatrix& labels, SRMatrix& features, int rStart, int rStop, Args& args);
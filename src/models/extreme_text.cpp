@@ -20,11 +20,14 @@
  SOFTWARE.
  */
 
+#include <filesystem>
+
 #include "extreme_text.h"
+#include "online_optimization.h"
 #include "threads.h"
 
 
-ExtremeText::ExtremeText() {
+ExtremeText::ExtremeText(): inputQuantized(false), step(0), totalSteps(0) {
     type = extremeText;
     name = "extremeText";
 }
@@ -43,69 +46,152 @@ void ExtremeText::trainThread(int threadId, ExtremeText* model, SRMatrix& labels
     }
 }
 
-Real ExtremeText::updateNode(TreeNode* node, Real label, Vector& hidden, Vector& gradient, Real lr, Real l2){
-    size_t i = node->index;
+thread_local ExtremeText::UpdateBuffers ExtremeText::updateBuffers;
+
+Real ExtremeText::updateNode(TreeNode* node, Real label, const Real* hidden, Real* gradient, Real lr, Real l2){
+    Real* output = outputW[node->index].data();
 
-    //Real pred = 1.0 / (1.0 + std::exp(-dotVectors(outputW[i], hidden)));
-    Real val = outputW[i].dot(hidden);
+    Real val = dotDenseVectors(output, hidden, dims);
     Real pred = sigmoid(val);
     Real grad = label - pred;
     //Log(COUT) << val << " " << pred << " " << grad << "\n";
 
+    // Gradient for the hidden vector and the update of the node vector in one pass
+    const Real lrGrad = lr * grad;
+    const Real lrL2 = lr * l2;
     for(int j = 0; j < dims; ++j){
-        gradient[j] += lr * (grad * outputW[i][j] - l2 * gradient[j]);
-        outputW[i][j] += lr * (grad * hidden[j] - l2 * outputW[i][j]);
+        const Real o = output[j];
+        gradient[j] += lrGrad * o - lrL2 * gradient[j];
+        output[j] = o + lrGrad * hidden[j] - lrL2 * o;
     }
 
     return label ? -log(pred) : -log(1.0 - pred);
 }
 
+void ExtremeText::gatherNodesToUpdate(UpdateBuffers& buffers, const SparseVector& labels){
+    // Nodes are marked with the stamp of the current update instead of inserting them into sets
+    if (buffers.visited.size() != tree->size()) {
+        buffers.visited.assign(tree->size(), 0);
+        buffers.stamp = 0;
+    }
+    if (++buffers.stamp == 0) { // Stamps wrapped around
+        std::fill(buffers.visited.begin(), buffers.visited.end(), 0);
+        buffers.stamp = 1;
+    }
+    const unsigned int stamp = buffers.stamp;
+    auto& visited = buffers.visited;
+
+    auto& nPositive = buffers.nPositive;
+    auto& nNegative = buffers.nNegative;
+    nPositive.clear();
+    nNegative.clear();
+
+    for (auto &l : labels) {
+        TreeNode* n = (l.index >= 0 && l.index < leavesByLabel.size()) ? leavesByLabel[l.index] : nullptr;
+        if (n == nullptr) {
+            Log(CERR) << "Encountered example with label " << l.index << " that does not exists in the tree\n";
+            continue;
+        }
+
+        // Stop at the path of the previous labels
+        for (; n != nullptr && visited[n->index] != stamp; n = n->parent) {
+            visited[n->index] = stamp;
+            nPositive.push_back(n);
+        }
+    }
+
+    if (nPositive.empty()) {
+        nNegative.push_back(tree->root);
+        return;
+    }
+
+    for (auto& n : nPositive) {
+        for (const auto &child : n->children)
+            if (visited[child->index] != stamp) nNegative.push_back(child);
+    }
+}
+
+void ExtremeText::setupRegularization(long long steps, const Args& args){
+    inputSteps.reset();
+    if (args.l1Penalty <= 0 && args.l2Penalty <= 0) return;
+
+    inputSteps = std::unique_ptr<std::atomic<long long>[]>(new std::atomic<long long>[inputW.rows()]);
+    for (int i = 0; i < inputW.rows(); ++i) inputSteps[i].store(0, std::memory_order_relaxed);
+    step = 0;
+    totalSteps = std::max(steps, 1LL);
+}
+
+void ExtremeText::regularizeInput(int index, long long currentStep, const Args& args){
+    // Each range of skipped steps is claimed by exactly one thread
+    long long last = inputSteps[index].load(std::memory_order_relaxed);
+    while (last < currentStep && !inputSteps[index].compare_exchange_weak(last, currentStep, std::memory_order_relaxed));
+    if (last >= currentStep) return;
+
+    // Average of the linearly decaying learning rate over the skipped steps
+    Real lr = args.eta * std::max(0.0, 1.0 - static_cast<double>(last + currentStep) / (2 * totalSteps));
+    Vector& input = inputW[index];
+    for(int j = 0; j < dims; ++j)
+        input[j] = lazyPenalty(input[j], lr, currentStep - last, args.l1Penalty, args.l2Penalty);
+}
+
+void ExtremeText::finalizeRegularization(const Args& args){
+    if (!inputSteps) return;
+    for (int i = 0; i < inputW.rows(); ++i) regularizeInput(i, step, args);
+    inputSteps.reset();
+}
+
 Real ExtremeText::update(Real lr, const SparseVector& features, const SparseVector& labels, const Args& args){
 
+    // Apply regularization of the skipped steps to input vectors of the example
+    if (inputSteps) {
+        long long currentStep = ++step;
+        for(auto &f : features) regularizeInput(f.index, currentStep, args);
+    }
+
+    auto& buffers = updateBuffers;
+
     // Compute hidden
     Real valuesSum = 0;
-    Vector hidden(dims);
+    buffers.hidden.assign(dims, 0);
+    Real* hidden = buffers.hidden.data();
     for(auto &f : features){
         valuesSum += f.value;
-        hidden.add(inputW[f.index], f.value);
+        addVector(inputW[f.index].data(), f.value, hidden, dims);
     }
-    hidden.div(valuesSum);
+    mulVector(hidden, 1.0 / valuesSum, dims);
 
     // Gather nodes to update
-    UnorderedSet<TreeNode*> nPositive;
-    UnorderedSet<TreeNode*> nNegative;
-
-    getNodesToUpdate(nPositive, nNegative, labels);
+    gatherNodesToUpdate(buffers, labels);
 
     // Compute gradient
-    Vector gradient(dims);
+    buffers.gradient.assign(dims, 0);
+    Real* gradient = buffers.gradient.data();
     //Real lr = 0.5 * args.eta * std::sqrt(1.0 / ++t);
     Real loss = 0.0;
-    for (auto &n : nPositive)
+    for (auto &n : buffers.nPositive)
         loss += updateNode(n, 1.0, hidden, gradient, lr, args.l2Penalty);
 
-    for (auto &n : nNegative)
+    for (auto &n : buffers.nNegative)
         loss += updateNode(n, 0.0, hidden, gradient, lr, args.l2Penalty);
 
     // Update input weights
-    gradient.div(valuesSum);
+    mulVector(gradient, 1.0 / valuesSum, dims);
     for(auto &f : features)
-        inputW[f.index].add(gradient, f.value);
+        addVector(gradient, f.value, inputW[f.index].data(), dims);
 
     return loss;
 }
 
-void ExtremeText::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) {
-
-    // Create tree
-    if (!tree) {
-        tree = std::make_unique<LabelTree>();
-        tree->buildTreeStructure(labels, features, args);
-    }
+void ExtremeText::initWeights(int featuresCount, Args& args) {
     m = tree->getNumberOfLeaves();
 
+    int maxLabel = -1;
+    for (auto& l : tree->leaves) maxLabel = std::max(maxLabel, l.first);
+    leavesByLabel.assign(maxLabel + 1, nullptr);
+    for (auto& l : tree->leaves) leavesByLabel[l.first] = l.second;
+
     dims = args.dims;
-    inputW = RMatrix<Vector>(features.cols(), dims);
+    inputW = RMatrix<Vector>(featuresCount, dims);
 
     std::default_random_engine rng(args.getSeed());
     std::uniform_real_distribution<Real> dist(-1.0 / dims, 1.0 / dims);
@@ -114,25 +200,146 @@ void ExtremeText::train(SRMatrix& labels, SRMatrix& features, Args& args, std::s
         for(int j = 0; j < inputW.cols(); ++j) inputW[i][j] = dist(rng);
 
     outputW = RMatrix<Vector>(tree->size(), dims);
+}
+
+void ExtremeText::quantize(Args& args) {
+    if (!args.quantize || inputQuantized) return;
+
+    Log(CERR) << "Quantizing input vectors ...\n";
+    unsigned long long memBefore = static_cast<unsigned long long>(inputW.rows()) * inputW.cols() * sizeof(Real);
+    qInputW.quantize(inputW);
+    inputW = Matrix();
+    inputQuantized = true;
+    Log(CERR) << "  Input vectors size: " << formatMem(memBefore) << " -> " << formatMem(qInputW.mem()) << "\n";
+}
+
+void ExtremeText::save(Args& args, std::string output) {
+    tree->saveToFile(joinPath(output, "tree.bin"));
+    tree->saveTreeStructure(joinPath(output, "tree"));
+
+    if (inputQuantized || args.quantizeOutput) {
+        std::ofstream out(joinPath(output, "XTQuantizedWeights.bin"));
+        saveVar(out, inputQuantized);
+        saveVar(out, args.quantizeOutput);
+        if (inputQuantized) qInputW.save(out);
+        else inputW.save(out);
+        if (args.quantizeOutput) {
+            QMatrix qOutputW;
+            qOutputW.quantize(outputW);
+            qOutputW.save(out);
+        } else outputW.save(out);
+        out.close();
+    } else {
+        std::ofstream out(joinPath(output, "XTWeights.bin"));
+        inputW.save(out);
+        outputW.save(out);
+        out.close();
+    }
+}
+
+void ExtremeText::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) {
+
+    // Create tree
+    if (!tree) {
+        tree = std::make_unique<LabelTree>();
+        tree->buildTreeStructure(labels, features, args);
+    }
+    initWeights(features.cols(), args);
+    setupRegularization(static_cast<long long>(features.rows()) * args.epochs, args);
 
     // Iterate over rows
     Log(CERR) << "Training extremeText for " << args.epochs << " epochs in " << args.threads << " threads ...\n";
 
-    ThreadSet tSet;
+    TaskSet tSet(args.threads);
     int tRows = ceil(static_cast<Real>(features.rows()) / args.threads);
     for (int t = 0; t < args.threads; ++t)
         tSet.add(trainThread, t, this, std::ref(labels), std::ref(features), std::ref(args), t * tRows,
                  std::min((t + 1) * tRows, features.rows()));
     tSet.joinAll();
+    finalizeRegularization(args);
+    quantize(args);
 
     // Save training output
-    tree->saveToFile(joinPath(output, "tree.bin"));
-    tree->saveTreeStructure(joinPath(output, "tree"));
+    save(args, output);
+}
+
+void ExtremeText::streamTrainThread(int threadId, ExtremeText* model, DataStream& stream, Args& args,
+                                    std::atomic<long long>& processed, const long long examples) {
+    std::shared_ptr<DataBatch> batch;
+    Real loss = 0;
+    long long i = 0;
+    while ((batch = stream.next()) != nullptr) {
+        for (int r = 0; r < batch->features.rows(); ++r, ++i) {
+            long long p = processed++;
+            Real lr = args.eta * std::max(0.0, 1.0 - (static_cast<double>(p) / examples));
+            if (!threadId) printProgress(p, examples, lr, loss / (i + 1));
+            loss += model->update(lr, batch->features[r], batch->labels[r], args);
+        }
+    }
+}
+
+void ExtremeText::trainOnStream(Args& args, std::string output) {
+
+    // First pass over the data to gather labels' priors (required to build the tree) and the number of features,
+    // the labels themselves are not kept, only their counts
+    Log(CERR) << "Scanning data stream for labels and features ...\n";
+    std::vector<Prediction> labelsPriors;
+    long long rows = 0;
+    int featuresCount = args.hash ? args.hash + 2 : 0;
+    {
+        DataStream stream(args);
+        std::shared_ptr<DataBatch> batch;
+        while ((batch = stream.next()) != nullptr) {
+            for (int r = 0; r < batch->labels.rows(); ++r) {
+                for (const auto& l : batch->labels[r]) {
+                    if (static_cast<size_t>(l.index) >= labelsPriors.size()) {
+                        size_t prevSize = labelsPriors.size();
+                        labelsPriors.resize(l.index + 1);
+                        for (size_t i = prevSize; i < labelsPriors.size(); ++i) labelsPriors[i].label = i;
+                    }
+                    ++labelsPriors[l.index].value;
+                }
+            }
+            rows += batch->labels.rows();
+            featuresCount = std::max(featuresCount, batch->features.cols());
+        }
+        stream.join();
+    }
+    if (rows) for (auto& p : labelsPriors) p.value /= rows;
+    Log(CERR) << "  Rows: " << rows << ", features: " << featuresCount - 2 << ", labels: " << labelsPriors.size() << "\n";
+
+    // Create tree
+    if (!tree) {
+        tree = std::make_unique<LabelTree>();
+        tree->buildTreeStructure(labelsPriors, args);
+    }
+    initWeights(featuresCount, args);
+    setupRegularization(rows * args.epochs, args);
+
+    // Iterate over batches of rows, learning rate decays with the total number of processed examples
+    Log(CERR) << "Training extremeText on data stream for " << args.epochs << " epochs in " << args.threads << " threads ...\n";
+
+    std::atomic<long long> processed(0);
+    const long long examples = rows * args.epochs;
+    DataStream stream(args, args.epochs);
+    TaskSet tSet(args.threads);
+    for (int t = 0; t < args.threads; ++t)
+        tSet.add(streamTrainThread, t, this, std::ref(stream), std::ref(args), std::ref(processed), examples);
+    tSet.joinAll();
+    stream.join();
+    finalizeRegularization(args);
+    quantize(args);
 
-    std::ofstream out(joinPath(output, "XTWeights.bin"));
-    inputW.save(out);
-    outputW.save(out);
-    out.close();
+    // Save training output
+    save(args, output);
+}
+
+void ExtremeText::compact(Args& args, const std::string& infile, const std::string& outfile) {
+    throw std::invalid_argument("Compaction is not supported by extremeText model, use --quantize option to reduce its size");
+}
+
+void ExtremeText::profile(SRMatrix& features, Args& args, const std::string& infile) {
+    throw std::invalid_argument("Profiling is not supported by extremeText model, it has no separate base classifiers");
 }
 
 void ExtremeText::load(Args& args, std::string infile) {
@@ -141,13 +348,32 @@ void ExtremeText::load(Args& args, std::string infile) {
     tree = std::make_unique<LabelTree>();
     tree->loadFromFile(joinPath(infile, "tree.bin"));
 
-    std::ifstream in(joinPath(infile, "XTWeights.bin"));
-    inputW.load(in);
-    outputW.load(in);
-    in.close();
+    std::string quantizedFile = joinPath(infile, "XTQuantizedWeights.bin");
+    if (std::filesystem::exists(quantizedFile)) {
+        std::ifstream in(quantizedFile);
+        bool outputQuantized;
+        loadVar(in, inputQuantized);
+        loadVar(in, outputQuantized);
+        if (inputQuantized) qInputW.load(in);
+        else inputW.load(in);
+        if (outputQuantized) {
+            QMatrix qOutputW;
+            qOutputW.load(in);
+            outputW = qOutputW.dequantize();
+        } else outputW.load(in);
+        in.close();
+    } else {
+        std::ifstream in(joinPath(infile, "XTWeights.bin"));
+        inputW.load(in);
+        outputW.load(in);
+        in.close();
+    }
+
+    // Post-training quantization of the loaded model, only in memory
+    quantize(args);
 
-    assert(inputW.cols() == outputW.cols());
-    dims = inputW.cols();
+    dims = inputQuantized ? qInputW.cols() : inputW.cols();
+    assert(dims == outputW.cols());
 
     assert(tree->size() == outputW.rows());
     m = tree->getNumberOfLeaves();
@@ -155,6 +381,132 @@ void ExtremeText::load(Args& args, std::string infile) {
     loaded = true;
 }
 
+std::vector<std::vector<Prediction>> ExtremeText::predictBatch(SRMatrix& features, Args& args) {
+    if (args.treeSearchType == exact) return Model::predictBatch(features, args);
+    else if (args.treeSearchType == beam) return predictWithBatchedBeamSearch(features, args);
+    else throw std::invalid_argument("Unknown tree search type");
+}
+
+std::vector<std::vector<Prediction>> ExtremeText::predictWithBatchedBeamSearch(SRMatrix& features, Args& args) {
+    Log(CERR) << "Starting batched prediction in " << args.threads << " threads ...\n";
+
+    int rows = features.rows();
+    std::vector<std::vector<Prediction>> prediction(rows);
+
+    // Rows are processed in fixed-size chunks, so hidden vectors and beams of the whole input are not kept in memory
+    const int chunkRows = std::max(args.threads, 1) * 1024;
+    for (int startRow = 0; startRow < rows; startRow += chunkRows) {
+        const int stopRow = std::min(startRow + chunkRows, rows);
+        predictChunkWithBatchedBeamSearch(prediction, features, startRow, stopRow, args);
+        ::printProgress(startRow, stopRow, rows);
+    }
+
+    dataPointCount += rows;
+    return prediction;
+}
+
+void ExtremeText::predictChunkWithBatchedBeamSearch(std::vector<std::vector<Prediction>>& prediction, SRMatrix& features,
+                                                    int startRow, int stopRow, Args& args) {
+    int rows = stopRow - startRow;
+    int threads = std::max(args.threads, 1);
+
+    // Compute hidden vectors of all examples of the chunk, rows below are relative to the chunk
+    std::vector<Real> hidden(static_cast<size_t>(rows) * dims);
+    {
+        TaskSet tSet(threads);
+        int tRows = ceil(static_cast<Real>(rows) / threads);
+        for (int t = 0; t < threads; ++t)
+            tSet.add([&, t]() {
+                for (int r = t * tRows; r < std::min((t + 1) * tRows, rows); ++r)
+                    computeHidden(features[startRow + r], hidden.data() + static_cast<size_t>(r) * dims);
+            });
+        tSet.joinAll();
+    }
+
+    auto ifAdd = [&](TreeNode* node, Real prob) {
+        if (args.threshold > 0) return prob >= args.threshold;
+        if (!thresholds.empty()) return prob >= nodesThr[node->index].value;
+        return true;
+    };
+    auto calculateValue = [&](TreeNode* node, Real prob) {
+        if (!labelsWeights.empty()) return prob * nodesWeights[node->index].value + nodesBiases[node->index].value;
+        return prob;
+    };
+
+    // Root is scored as the only child of the virtual node
+    std::vector<TreeNode*> rootLevel = {tree->root};
+    std::vector<NodeExpansion> expansions(1);
+    expansions[0].node = nullptr;
+    for (int r = 0; r < rows; ++r) expansions[0].rows.emplace_back(r, 1.0);
+
+    std::vector<std::vector<TreeNodeValue>> levelPredictions(rows);
+    std::vector<int> expansionOfNode(tree->size(), -1);
+
+    while (!expansions.empty()) {
+        // Score examples expanding each node against its children
+        TaskSet tSet(threads);
+        for (int t = 0; t < threads; ++t)
+            tSet.add([&, t]() {
+                std::vector<const Real*> A;
+                std::vector<const Real*> B;
+                for (size_t e = t; e < expansions.size(); e += threads) {
+                    auto& exp = expansions[e];
+                    auto& children = exp.node ? exp.node->children : rootLevel;
+                    A.clear();
+                    B.clear();
+                    for (auto& r : exp.rows) A.push_back(hidden.data() + static_cast<size_t>(r.first) * dims);
+                    for (auto& c : children) B.push_back(outputW[c->index].data());
+                    exp.scores.resize(A.size() * B.size());
+                    mulMatricesNT(A.data(), B.data(), exp.scores.data(), A.size(), B.size(), dims);
+                }
+            });
+        tSet.joinAll();
+
+        // Gather predictions of labels and nodes for each example
+        for (auto& exp : expansions) {
+            auto& children = exp.node ? exp.node->children : rootLevel;
+            size_t n = children.size();
+            for (size_t i = 0; i < exp.rows.size(); ++i) {
+                int r = exp.rows[i].first;
+                for (size_t j = 0; j < n; ++j) {
+                    TreeNode* c = children[j];
+                    Real prob = exp.rows[i].second / (1.0 + std::exp(-exp.scores[i * n + j]));
+                    if (!ifAdd(c, prob)) continue;
+                    Real value = calculateValue(c, prob);
+                    if (c->label >= 0) prediction[startRow + r].emplace_back(c->label, value);
+                    if (!c->children.empty()) levelPredictions[r].emplace_back(c, prob, value);
+                }
+            }
+            nodeEvaluationCount += exp.rows.size() * n;
+        }
+
+        // Keep the best nodes of each example and group the examples by the nodes to expand
+        expansions.clear();
+        for (int r = 0; r < rows; ++r) {
+            auto& v = levelPredictions[r];
+            std::sort(v.rbegin(), v.rend());
+            if (args.threshold <= 0 && thresholds.empty()) v.resize(std::min(v.size(), (size_t)args.beamSearchWidth));
+
+            for (auto& nv : v) {
+                int& e = expansionOfNode[nv.node->index];
+                if (e == -1) {
+                    e = expansions.size();
+                    expansions.push_back({nv.node, {}, {}});
+                }
+                expansions[e].rows.emplace_back(r, nv.prob);
+            }
+            v.clear();
+        }
+        for (auto& exp : expansions) expansionOfNode[exp.node->index] = -1;
+    }
+
+    for (int r = startRow; r < stopRow; ++r) {
+        auto& p = prediction[r];
+        std::sort(p.rbegin(), p.rend());
+        if (args.topK > 0 && p.size() > args.topK) p.resize(args.topK);
+    }
+}
+
 void ExtremeText::predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args){
     auto hidden = computeHidden(features);
     PLT::predict(prediction, hidden, args);
@@ -166,17 +518,33 @@ Real ExtremeText::predictForLabel(Label label, SparseVector& features, Args& arg
     return value;
 }
 
+std::vector<Real> ExtremeText::predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args){
+    auto hidden = computeHidden(features);
+    return PLT::predictForLabels(labels, hidden, args);
+}
+
 SparseVector ExtremeText::computeHidden(const SparseVector& features){
-    SparseVector hidden(dims, dims);
-    for(size_t i = 0; i < dims; ++i) hidden.insertD(i, 0);
+    std::vector<Real> denseHidden(dims);
+    computeHidden(features, denseHidden.data());
+
+    // All dimensions are kept, also the zero ones
+    std::vector<IRVPair> hidden(dims);
+    for(int i = 0; i < dims; ++i) hidden[i] = {i, denseHidden[i]};
+
+    return SparseVector(hidden);
+}
+
+void ExtremeText::computeHidden(const SparseVector& features, Real* hidden){
+    std::fill(hidden, hidden + dims, 0);
 
     Real valuesSum = 0;
+    const int inputRows = inputQuantized ? qInputW.rows() : inputW.rows();
     for(auto &f : features){
+        if(f.index >= inputRows) continue; // Feature not seen during training
         valuesSum += f.value;
-        hidden.add(inputW[f.index], f.value);
+        if(inputQuantized) qInputW.addRow(f.index, f.value, hidden);
+        else addVector(inputW[f.index].data(), f.value, hidden, dims);
     }
 
-    hidden.div(valuesSum);
-
-    return hidden;
+    if(valuesSum != 0) mulVector(hidden, 1.0 / valuesSum, dims);
 }
\ No newline at end of file
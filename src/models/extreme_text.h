@@ -22,7 +22,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+
 #include "plt.h"
+#include "read_data.h"
 
 typedef Real XTWeight;
 
@@ -31,21 +35,68 @@ public:
     ExtremeText();
 
     void train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) override;
+    void trainOnStream(Args& args, std::string output) override;
 
     void predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) override;
     Real predictForLabel(Label label, SparseVector& features, Args& args) override;
+    std::vector<Real> predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) override;
+    std::vector<std::vector<Prediction>> predictBatch(SRMatrix& features, Args& args) override;
 
     void load(Args& args, std::string infile) override;
+    void compact(Args& args, const std::string& infile, const std::string& outfile) override;
+    void profile(SRMatrix& features, Args& args, const std::string& infile) override;
 
 protected:
     Matrix inputW;  // Input vectors (word vectors)
     Matrix outputW; // Tree node vectors
     int dims;
 
+    // Input vectors quantized to 8-bit integers, they replace inputW after training or loading
+    QMatrix qInputW;
+    bool inputQuantized;
+    void quantize(Args& args);
+
+    // Lazy regularization of input vectors, they are regularized only when their features appear in an example
+    std::unique_ptr<std::atomic<long long>[]> inputSteps; // Step of the last regularization of input vectors
+    std::atomic<long long> step;
+    long long totalSteps;
+
+    void setupRegularization(long long steps, const Args& args);
+    void regularizeInput(int index, long long currentStep, const Args& args);
+    void finalizeRegularization(const Args& args);
+
+    // Buffers of training threads, reused between updates
+    struct UpdateBuffers {
+        std::vector<Real> hidden;
+        std::vector<Real> gradient;
+        std::vector<unsigned int> visited; // Stamps of nodes already gathered for the current update
+        unsigned int stamp = 0;
+        std::vector<TreeNode*> nPositive;
+        std::vector<TreeNode*> nNegative;
+    };
+    static thread_local UpdateBuffers updateBuffers;
+    std::vector<TreeNode*> leavesByLabel; // Leaves indexed by label, for gathering nodes without hashing
+
     Real update(Real lr, const SparseVector& features, const SparseVector& labels, const Args& args);
-    Real updateNode(TreeNode* node, Real label, Vector& hidden, Vector& gradient, Real lr, Real l2);
+    Real updateNode(TreeNode* node, Real label, const Real* hidden, Real* gradient, Real lr, Real l2);
+    void gatherNodesToUpdate(UpdateBuffers& buffers, const SparseVector& labels);
 
     SparseVector computeHidden(const SparseVector& features);
+    void computeHidden(const SparseVector& features, Real* hidden);
+
+    // Beam search over the whole batch, level by level, the examples that expand the same node are scored
+    // against all its children at once with the product of their hidden vectors and children vectors
+    struct NodeExpansion {
+        TreeNode* node;
+        std::vector<std::pair<int, Real>> rows; // Rows of examples and probabilities of the node
+        std::vector<Real> scores; // Rows x children scores
+    };
+    std::vector<std::vector<Prediction>> predictWithBatchedBeamSearch(SRMatrix& features, Args& args);
+    void predictChunkWithBatchedBeamSearch(std::vector<std::vector<Prediction>>& prediction, SRMatrix& features,
+                                           int startRow, int stopRow, Args& args);
+
+    void initWeights(int featuresCount, Args& args);
+    void save(Args& args, std::string output);
 
     inline Real predictForNode(TreeNode* node, SparseVector& features) override {
         return 1.0 / (1.0 + std::exp(-outputW[node->index].dot(features)));
@@ -53,9 +104,11 @@ protected:
 
     static void trainThread(int threadId, ExtremeText* model, SRMatrix& labels,
                                   SRMatrix& features, Args& args, const int startRow, const int stopRow);
+    static void streamTrainThread(int threadId, ExtremeText* model, DataStream& stream, Args& args,
+                                  std::atomic<long long>& processed, const long long examples);
 
-    static void printProgress(int state, int max, Real lr, Real loss) {
-        if (max > 100 && state % (max / 100) == 0)
+    static void printProgress(long long state, long long max, Real lr, Real loss) {
+        if (Log::getProgress() && max > 100 && state % (max / 100) == 0)
             Log(CERR) << "  Progress: " << state / (max / 100) << "%, lr: " << lr << ", loss: " << loss << "\r";
     }
 
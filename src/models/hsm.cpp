@@ -116,6 +116,7 @@ void HSM::getNodesToUpdate(UnorderedSet<TreeNode*>& nPositive, UnorderedSet<Tree
 Prediction HSM::predictNextLabel(
     std::function<bool(TreeNode*, Real)>& ifAddToQueue, std::function<Real(TreeNode*, Real)>& calculateValue,
     TopKQueue<TreeNodeValue>& nQueue, SparseVector& features) {
+    auto& localBases = getLocalBases(bases);
 
     while (!nQueue.empty()) {
         TreeNodeValue nVal = nQueue.top();
@@ -123,7 +124,8 @@ Prediction HSM::predictNextLabel(
 
         if (!nVal.node->children.empty()) {
             if (nVal.node->children.size() == 2) {
-                Real value = bases[nVal.node->children[0]->index]->predictProbability(features);
+                Real value = localBases[nVal.node->children[0]->index]->predictProbability(features);
+                countNodeEvaluation(nVal.node->children[0]);
                 addToQueue(ifAddToQueue, calculateValue, nQueue, nVal.node->children[0], nVal.value * value);
                 addToQueue(ifAddToQueue, calculateValue, nQueue, nVal.node->children[1], nVal.value * (1.0 - value));
                 ++nodeEvaluationCount;
@@ -132,7 +134,8 @@ Prediction HSM::predictNextLabel(
                 std::vector<Real> values;
                 values.reserve(nVal.node->children.size());
                 for (const auto& child : nVal.node->children) {
-                    values.emplace_back(std::exp(bases[child->index]->predictValue(features))); // Softmax normalization
+                    values.emplace_back(std::exp(localBases[child->index]->predictValue(features))); // Softmax normalization
+                    countNodeEvaluation(child);
                     sum += values.back();
                 }
 
@@ -148,33 +151,35 @@ Prediction HSM::predictNextLabel(
     return {-1, 0};
 }
 
-Real HSM::predictForLabel(Label label, SparseVector& features, Args& args) {
+TreeNode* HSM::nodeToCollapse(TreeNode* parent, TreeNode* child) {
+    // Probability of the only child is always 1, so its estimator is never used
+    if (child->label < 0 || parent->label < 0) return child;
+    return nullptr;
+}
+
+Real HSM::predictForNodeOnPath(TreeNode* node, SparseVector& features) {
+    TreeNode* p = node->parent;
+    if (p == nullptr) return 1; // Root is always reached
+
+    auto& localBases = getLocalBases(bases);
+    if (p->children.size() == 2) { // Binary node has just 1 probability estimator
+        Real value = localBases[p->children[0]->index]->predictProbability(features);
+        countNodeEvaluation(p->children[0]);
+        ++nodeEvaluationCount;
+        return (node == p->children[0]) ? value : 1.0 - value;
+    }
+
+    Real sum = 0;
     Real value = 0;
-    TreeNode* n = tree->leaves[label];
-    while (n->parent) {
-        if (n->parent->children.size() == 2) {
-            if (n == n->parent->children[0])
-                value *= bases[n->children[0]->index]->predictProbability(features);
-            else
-                value *= 1.0 - bases[n->children[0]->index]->predictProbability(features);
-            ++nodeEvaluationCount;
-        } else {
-            Real sum = 0;
-            Real tmpValue = 0;
-            for (const auto& child : n->parent->children) {
-                if (child == n) {
-                    tmpValue = std::exp(bases[child->index]->predictValue(features)); // Softmax normalization
-                    sum += tmpValue;
-                } else
-                    sum += std::exp(bases[child->index]->predictValue(features));
-            }
-            value *= tmpValue / sum;
-            nodeEvaluationCount += n->parent->children.size();
-        }
-        n = n->parent;
+    for (const auto& child : p->children) {
+        Real childValue = std::exp(localBases[child->index]->predictValue(features)); // Softmax normalization
+        countNodeEvaluation(child);
+        if (child == node) value = childValue;
+        sum += childValue;
     }
+    nodeEvaluationCount += p->children.size();
 
-    return value;
+    return value / sum;
 }
 
 void HSM::printInfo() {
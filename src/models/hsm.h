@@ -39,7 +39,6 @@ class HSM : public BatchPLT { // HSM is multi-class version of PLT
 public:
     HSM();
 
-    Real predictForLabel(Label label, SparseVector& features, Args& args) override;
     void printInfo() override;
 
 protected:
@@ -47,6 +46,8 @@ protected:
                           std::vector<std::vector<Feature*>>& binFeatures,
                           std::vector<std::vector<Real>>& binWeights,
                           SRMatrix& labels, SRMatrix& features, Args& args) override;
+    Real predictForNodeOnPath(TreeNode* node, SparseVector& features) override;
+    TreeNode* nodeToCollapse(TreeNode* parent, TreeNode* child) override;
     void getNodesToUpdate(UnorderedSet<TreeNode*>& nPositive, UnorderedSet<TreeNode*>& nNegative, int rLabel);
     Prediction predictNextLabel(
         std::function<bool(TreeNode*, Real)>& ifAddToQueue, std::function<Real(TreeNode*, Real)>& calculateValue,
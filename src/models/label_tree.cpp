@@ -68,7 +68,7 @@ void LabelTree::buildTreeStructure(int labelCount, Args& args) {
         throw std::invalid_argument("Unknown tree type");
 }
 
-void LabelTree::buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& args) {
+void LabelTree::buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& args, SRMatrix* labelsFeatures) {
     clear();
 
     // Load tree structure from file
@@ -88,11 +88,14 @@ void LabelTree::buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& a
     else if (args.treeType == huffman)
         buildHuffmanTree(labels, args);
     else if (args.treeType == hierarchicalKmeans) {
-        SRMatrix labelsFeatures;
-        computeLabelsFeaturesMatrix(labelsFeatures, labels, features, args.threads, args.norm,
-                                    args.kmeansWeightedFeatures);
-        //labelsFeatures.dump(joinPath(args.output, "lf_mat.txt"));
-        buildKmeansTree(labelsFeatures, args);
+        if (labelsFeatures != nullptr) buildKmeansTree(*labelsFeatures, args); // Precomputed, e.g. shared by ensemble members
+        else {
+            SRMatrix newLabelsFeatures;
+            computeLabelsFeaturesMatrix(newLabelsFeatures, labels, features, args.threads, args.norm,
+                                        args.kmeansWeightedFeatures);
+            //newLabelsFeatures.dump(joinPath(args.output, "lf_mat.txt"));
+            buildKmeansTree(newLabelsFeatures, args);
+        }
     } else if (args.treeType == onlineKaryComplete || args.treeType == onlineKaryRandom)
         buildOnlineTree(labels, features, args);
     else if (args.treeType < custom)
@@ -107,6 +110,35 @@ void LabelTree::buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& a
     Log(CERR) << "  Nodes: " << nodes.size() << ", leaves: " << leaves.size() << "\n";
 }
 
+void LabelTree::buildTreeStructure(const std::vector<Prediction>& labelsPriors, Args& args) {
+    clear();
+
+    // Load tree structure from file
+    if (!args.treeStructure.empty()) loadTreeStructure(args.treeStructure);
+
+    // Create a tree structure
+    Log(CERR) << "Building tree ...\n";
+
+    if (args.treeType == completeKaryInOrder)
+        buildCompleteTree(labelsPriors.size(), false, args);
+    else if (args.treeType == completeKaryRandom)
+        buildCompleteTree(labelsPriors.size(), true, args);
+    else if (args.treeType == balancedInOrder)
+        buildBalancedTree(labelsPriors.size(), false, args);
+    else if (args.treeType == balancedRandom)
+        buildBalancedTree(labelsPriors.size(), true, args);
+    else if (args.treeType == huffman)
+        buildHuffmanTree(labelsPriors, args);
+    else if (args.treeType < custom)
+        throw std::invalid_argument("This tree type requires features of the training examples");
+    else if (args.treeType != custom)
+        throw std::invalid_argument("Unknown tree type");
+
+    if(args.flattenTree) flattenTree(args.flattenTree);
+
+    Log(CERR) << "  Nodes: " << nodes.size() << ", leaves: " << leaves.size() << "\n";
+}
+
 TreeNodePartition LabelTree::buildKmeansTreeThread(TreeNodePartition nPart, SRMatrix& labelsFeatures, Args& args,
                                               int seed) {
     kmeans(nPart.partition, labelsFeatures, args.arity, args.kmeansEps, args.kmeansBalanced, seed);
@@ -127,12 +159,12 @@ void LabelTree::buildKmeansTree(SRMatrix& labelsFeatures, Args& args) {
     for (int i = 0; i < k; ++i) (*partition)[i].index = i;
 
     // Run clustering in parallel
-    ThreadPool tPool(args.threads);
+    TaskSet tSet(args.threads);
     std::vector<std::future<TreeNodePartition>> results;
 
     TreeNodePartition rootPart = {root, partition};
     results.emplace_back(
-        tPool.enqueue(buildKmeansTreeThread, rootPart, std::ref(labelsFeatures), std::ref(args), kmeansSeeder(rng)));
+        tSet.add(buildKmeansTreeThread, rootPart, std::ref(labelsFeatures), std::ref(args), kmeansSeeder(rng)));
 
     for (int r = 0; r < results.size(); ++r) {
         // Enqueuing new clustering tasks in the main thread ensures determinism
@@ -160,8 +192,8 @@ void LabelTree::buildKmeansTree(SRMatrix& labelsFeatures, Args& args) {
                 delete partitions[i];
             } else {
                 TreeNodePartition childPart = {n, partitions[i]};
-                results.emplace_back(tPool.enqueue(buildKmeansTreeThread, childPart, std::ref(labelsFeatures),
-                                                   std::ref(args), kmeansSeeder(rng)));
+                results.emplace_back(tSet.add(buildKmeansTreeThread, childPart, std::ref(labelsFeatures),
+                                               std::ref(args), kmeansSeeder(rng)));
             }
         }
 
@@ -170,10 +202,13 @@ void LabelTree::buildKmeansTree(SRMatrix& labelsFeatures, Args& args) {
 }
 
 void LabelTree::buildHuffmanTree(SRMatrix& labels, Args& args) {
+    buildHuffmanTree(computeLabelsPriors(labels), args);
+}
+
+void LabelTree::buildHuffmanTree(const std::vector<Prediction>& labelsProb, Args& args) {
     Log(CERR) << "Building Huffman Tree ...\n";
 
-    int k = labels.cols();
-    auto labelsProb = computeLabelsPriors(labels);
+    int k = labelsProb.size();
 
     std::priority_queue<TreeNodeValue, std::vector<TreeNodeValue>, std::greater<>> probQueue;
     for (int i = 0; i < k; i++) {
@@ -649,6 +684,17 @@ int LabelTree::getTreeDepth(TreeNode* rootNode) {
     return maxDepth;
 }
 
+size_t LabelTree::checksum() {
+    std::vector<int> structure;
+    structure.reserve(nodes.size() * 3);
+    for (auto& n : nodes) {
+        structure.push_back(n->parent != nullptr ? n->parent->index : -1);
+        structure.push_back(n->index);
+        structure.push_back(n->label);
+    }
+    return robin_hood::hash_bytes(structure.data(), structure.size() * sizeof(int));
+}
+
 int LabelTree::getNodeDepth(TreeNode* n) {
     uint32_t nDepth = 1;
 
@@ -78,13 +78,15 @@ public:
 
     // Build tree structure of given type
     void buildTreeStructure(int labelCount, Args& args);
-    void buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& args);
+    void buildTreeStructure(SRMatrix& labels, SRMatrix& features, Args& args, SRMatrix* labelsFeatures = nullptr);
+    void buildTreeStructure(const std::vector<Prediction>& labelsPriors, Args& args); // For trees that don't need features
 
     // Hierarchical K-Means
     void buildKmeansTree(SRMatrix& labelsFeatures, Args& args);
 
     // Huffman tree
     void buildHuffmanTree(SRMatrix& labels, Args& args);
+    void buildHuffmanTree(const std::vector<Prediction>& labelsPriors, Args& args);
 
     // Just random complete and balance tree
     void buildCompleteTree(int labelCount, bool randomizeOrder, Args& args);
@@ -126,6 +128,7 @@ public:
     int getNumberOfLeaves(TreeNode* rootNode = nullptr);
     int getTreeDepth(TreeNode* rootNode = nullptr);
     int getNodeDepth(TreeNode* n);
+    size_t checksum(); // Hash of the tree structure, changes with any change of nodes' indices, parents or labels
     TreeNode* createTreeNode(TreeNode* parent = nullptr, int label = -1);
     inline void setParent(TreeNode* n, TreeNode* parent) {
         n->parent = parent;
@@ -15,11 +15,20 @@
 
 
 MACH::MACH() {
-
+    type = mach;
+    name = "MACH";
 }
 
-MACH::~MACH() {
+MACH::~MACH() { unload(); }
+
+void MACH::unload() {
     for (auto b : bases) delete b;
+    bases.clear();
+    bases.shrink_to_fit();
+    hashes.clear();
+    baseToLabels.clear();
+    baseToLabels.shrink_to_fit();
+    loaded = false;
 }
 
 bool MACH::isPrime(int number){
@@ -47,7 +56,7 @@ void MACH::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string o
     m = labels.cols();
 
     // Generate hashes and save them to file
-    std::ofstream out(joinPath(output, "graph.bin"));
+    std::ofstream out(joinPath(output, "hashes.bin"));
     out.write((char*)&m, sizeof(m));
     out.write((char*)&bucketCount, sizeof(bucketCount));
     out.write((char*)&hashCount, sizeof(hashCount));
@@ -67,76 +76,155 @@ void MACH::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string o
     int size = hashes.size() * bucketCount;
 
     int rows = features.rows();
-    int lCols = labels.cols();
     assert(rows == labels.rows());
 
-    std::vector<std::vector<Real>> binLabels(size);
-    for (int i = 0; i < binLabels.size(); ++i) binLabels[i].reserve(rows);
+    std::vector<Real> binWeights(rows, 1);
+    std::vector<Feature*> binFeatures(rows);
+    for(int r = 0; r < rows; ++r) binFeatures[r] = features[r].data();
 
-    for (int r = 0; r < rows; ++r) {
-        printProgress(r, rows);
-
-        for (int i = 0; i < binLabels.size(); ++i) binLabels[i].push_back(0.0);
+    // Bases are trained in parts of consecutive buckets, only positive rows of each bucket are stored
+    int parts = calculateNumberOfParts(labels, features, args);
+    int range = size / parts + 1;
+    std::vector<std::vector<int>> binPositives(range);
+    std::vector<ProblemData> binProblemData;
 
-        for (auto &l : labels[r]){
-            for (int j = 0; j < hashes.size(); ++j)
-                binLabels[baseForLabel(l.index, j)].back() = 1.0;
+    std::ofstream weightsOut(joinPath(output, "weights.bin"), std::ios::out | std::ios::binary);
+    saveVar(weightsOut, size);
+
+    for (int p = 0; p < parts; ++p) {
+        int bStart = p * range;
+        int bStop = std::min((p + 1) * range, size);
+
+        if (parts > 1)
+            Log(CERR) << "Assigning labels for base estimators [" << bStart << ", " << bStop << ") (" << p + 1 << "/" << parts << ") ...\n";
+        else
+            Log(CERR) << "Assigning labels for base estimators ...\n";
+
+        unsigned long long positives = 0;
+        for (int r = 0; r < rows; ++r) {
+            printProgress(r, rows);
+            for (auto &l : labels[r]) {
+                for (int j = 0; j < hashes.size(); ++j) {
+                    int b = baseForLabel(l.index, j);
+                    if (b < bStart || b >= bStop) continue;
+                    auto& bPositives = binPositives[b - bStart];
+                    if (bPositives.empty() || bPositives.back() != r) { // Labels of the row may share the bucket
+                        bPositives.push_back(r);
+                        ++positives;
+                    }
+                }
+            }
         }
-    }
-
+        Log(CERR) << "  Temporary data size: " << formatMem(positives * sizeof(int) + range * sizeof(std::vector<int>)) << "\n";
 
+        for(int b = bStart; b < bStop; ++b) binProblemData.emplace_back(binPositives[b - bStart], binFeatures, features.cols(), binWeights);
+        trainBases(weightsOut, binProblemData, args);
 
-    // Train bases
-    std::vector<ProblemData> binProblemData;
-    std::vector<Real> binWeights(features.rows(), 1);
-    std::vector<Feature*> binFeatures(features.rows());
-    for(int i = 0; i < features.rows(); ++i)
-        binFeatures[i] = features[i].data();
+        for (auto& bp : binPositives) {
+            bp.clear();
+            bp.shrink_to_fit();
+        }
+        binProblemData.clear();
+    }
 
-    for(int i = 0; i < size; ++i) binProblemData.emplace_back(binLabels[i], binFeatures, features.cols(), binWeights);
-    trainBases(joinPath(output, "weights.bin"), binProblemData, args);
+    weightsOut.close();
 }
 
-void MACH::predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) {
-    // Brute force prediction
-    prediction.reserve(m);
-    for (int i = 0; i < m; ++i){
-        prediction.push_back({i, 1.0});
-    }
+size_t MACH::calculateNumberOfParts(SRMatrix& labels, SRMatrix& features, Args& args){
+    int rows = features.rows();
+    int size = args.machHashes * args.machBuckets;
+
+    // Calculate required memory
+    unsigned long long dataMem = labels.mem() + features.mem();
+    unsigned long long tmpDataMem = static_cast<unsigned long long>(labels.cells()) * args.machHashes * sizeof(int)
+                                    + size * sizeof(std::vector<int>);
+    // Weights and labels materialized for bases trained at the moment
+    unsigned long long baseMem = args.threads * (4 * features.cols() + rows) * sizeof(Real);
+    unsigned long long reqMem = tmpDataMem + dataMem + baseMem;
+    Log(CERR) << "Required memory to train: " << formatMem(reqMem) << " (data: " << formatMem(dataMem)
+              << ", weights: " << formatMem(baseMem) << ", tmp data: " << formatMem(tmpDataMem) << "), available memory: " << formatMem(args.memLimit) << "\n";
+
+    if (args.memLimit <= dataMem + baseMem) return size;
+    size_t parts = tmpDataMem / (args.memLimit - dataMem - baseMem) + 1;
+    return std::min(parts, static_cast<size_t>(size));
+}
 
-    for (int i = 0; i < bases.size(); ++i) {
-        Real value = bases[i]->predictProbability(features);
-        for (const auto &l : baseToLabels[i]) {
-            prediction[l].value += value;
+void MACH::PredictionSelector::add(int label, Real value) {
+    if (topK > 0) {
+        // Bounded heap, the smallest of the top k predictions is on the top
+        if (heap.size() < topK) {
+            heap.emplace_back(label, value);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Prediction>());
+        } else if (value > heap.front().value) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Prediction>());
+            heap.back() = {label, value};
+            std::push_heap(heap.begin(), heap.end(), std::greater<Prediction>());
         }
-    }
+    } else if (value >= threshold)
+        heap.emplace_back(label, value);
+}
 
-    sort(prediction.rbegin(), prediction.rend());
-    prediction.resize(args.topK);
-    prediction.shrink_to_fit();
+void MACH::PredictionSelector::finish(std::vector<Prediction>& prediction) {
+    sort(heap.rbegin(), heap.rend());
+    prediction.insert(prediction.end(), heap.begin(), heap.end());
+}
 
-    // TODO: Faster prediction
-    /*
-    std::priority_queue<Prediction> nQueue;
+void MACH::predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) {
     std::vector<Real> basePredictions(bases.size());
     for (int i = 0; i < bases.size(); ++i)
         basePredictions[i] = bases[i]->predictProbability(features);
 
-    //...
-     */
+    if (args.machTopBuckets > 0 && args.machTopBuckets < bucketCount)
+        predictWithCandidates(prediction, basePredictions, args);
+    else
+        predictExact(prediction, basePredictions, args);
+}
+
+void MACH::predictExact(std::vector<Prediction>& prediction, std::vector<Real>& basePredictions, Args& args) {
+    // Brute force prediction
+    std::vector<Real> labelsValues(m, 0);
+    for (int i = 0; i < bases.size(); ++i)
+        for (const auto &l : baseToLabels[i]) labelsValues[l] += basePredictions[i];
+
+    PredictionSelector selector(args);
+    for (int i = 0; i < m; ++i) selector.add(i, labelsValues[i] / hashes.size());
+    selector.finish(prediction);
+}
+
+void MACH::predictWithCandidates(std::vector<Prediction>& prediction, std::vector<Real>& basePredictions, Args& args) {
+    // Union of the labels from the top buckets of each hash are the candidates
+    UnorderedSet<int> candidates;
+    std::vector<int> buckets(bucketCount);
+    for (int i = 0; i < hashes.size(); ++i) {
+        Real* hashPredictions = basePredictions.data() + i * bucketCount;
+        for (int j = 0; j < bucketCount; ++j) buckets[j] = j;
+        std::nth_element(buckets.begin(), buckets.begin() + args.machTopBuckets, buckets.end(),
+                         [&](int b1, int b2) { return hashPredictions[b1] > hashPredictions[b2]; });
+
+        for (int j = 0; j < args.machTopBuckets; ++j)
+            for (const auto &l : baseToLabels[i * bucketCount + buckets[j]]) candidates.insert(l);
+    }
 
+    // Score only the candidates, with all the hashes
+    PredictionSelector selector(args);
+    for (const auto& l : candidates) {
+        Real value = 0;
+        for (int i = 0; i < hashes.size(); ++i) value += basePredictions[baseForLabel(l, i)];
+        selector.add(l, value / hashes.size());
+    }
+    selector.finish(prediction);
 }
 
 Real MACH::predictForLabel(Label label, SparseVector& features, Args& args) {
-    Real prob = 1;
+    Real value = 0;
     for (int i = 0; i < hashes.size(); ++i)
-        prob *= bases[baseForLabel(label, i)]->predictProbability(features);
-    return prob;
+        value += bases[baseForLabel(label, i)]->predictProbability(features);
+    return value / hashes.size();
 }
 
 void MACH::load(Args& args, std::string infile) {
     Log(CERR) << "Loading weights ...\n";
-    bases = loadBases(joinPath(infile, "weights.bin"));
+    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
 
     Log(CERR) << "Loading hashes ...\n";
     std::ifstream in(joinPath(infile, "hashes.bin"));
@@ -151,10 +239,17 @@ void MACH::load(Args& args, std::string infile) {
     }
     in.close();
 
-    // This is needed for fast brute force prediction
+    // Labels of each bucket, needed for both brute force and candidates prediction
     baseToLabels.resize(bases.size());
     for(int i = 0; i < m; ++i)
         for (int j = 0; j < hashes.size(); ++j)
             baseToLabels[baseForLabel(i, j)].push_back(i);
 
+    loaded = true;
+}
+
+void MACH::printInfo() {
+    Log(COUT) << name << " additional stats:"
+              << "\n  Number of hashes: " << hashes.size() << ", number of buckets per hash: " << bucketCount
+              << "\n  Number of estimators: " << bases.size() << "\n";
 }
@@ -18,7 +18,7 @@ public:
     int a;
     int b;
 
-    int hash(int value) { return a * value % b; };
+    int hash(int value) { return static_cast<long long>(a) * value % b; };
 };
 
 // Merged-Averaged Classifiers via Hashing
@@ -32,6 +32,10 @@ public:
     Real predictForLabel(Label label, SparseVector& features, Args& args) override;
 
     void load(Args& args, std::string infile) override;
+    void unload() override;
+
+    void printInfo() override;
+
     inline int baseForLabel(int label, int hash) {
         return (hash * bucketCount) + (hashes[hash].hash(label) % bucketCount);
     }
@@ -45,4 +49,23 @@ protected:
     int bucketCount; // B
     std::vector<UniversalHash> hashes; // of size R
     std::vector<std::vector<int>> baseToLabels;
+
+    static size_t calculateNumberOfParts(SRMatrix& labels, SRMatrix& features, Args& args);
+
+    // Prediction that scores all the labels
+    void predictExact(std::vector<Prediction>& prediction, std::vector<Real>& basePredictions, Args& args);
+
+    // Prediction that scores only the labels from the top buckets of each hash
+    void predictWithCandidates(std::vector<Prediction>& prediction, std::vector<Real>& basePredictions, Args& args);
+
+    // Keeps top k predictions or the predictions above the threshold if top k is not set
+    struct PredictionSelector {
+        PredictionSelector(Args& args): topK(args.topK), threshold(args.threshold) {}
+        void add(int label, Real value);
+        void finish(std::vector<Prediction>& prediction);
+
+        int topK;
+        Real threshold;
+        std::vector<Prediction> heap; // Min-heap of top k predictions
+    };
 };
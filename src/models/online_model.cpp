@@ -44,6 +44,7 @@ void OnlineModel::onlineTrainThread(int threadId, OnlineModel* model, SRMatrix&
                       << ", V mem peak (MB): " << res.peakVirtualMem / 1024 << "\n";
         }
     }
+    model->flushUpdates(args);
 }
 
 void OnlineModel::train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) {
@@ -56,12 +57,56 @@ void OnlineModel::train(SRMatrix& labels, SRMatrix& features, Args& args, std::s
     // Iterate over rows
     Log(CERR) << "Training online for " << args.epochs << " epochs in " << args.threads << " threads ...\n";
 
-    ThreadSet tSet;
+    startTraining(args, output);
+    TaskSet tSet(args.threads);
+    std::vector<std::future<void>> results;
     int tRows = ceil(static_cast<Real>(features.rows()) / args.threads);
     for (int t = 0; t < args.threads; ++t)
-        tSet.add(onlineTrainThread, t, this, std::ref(labels), std::ref(features), std::ref(args), t * tRows,
-                 std::min((t + 1) * tRows, features.rows()));
+        results.push_back(tSet.add(onlineTrainThread, t, this, std::ref(labels), std::ref(features), std::ref(args),
+                                   t * tRows, std::min((t + 1) * tRows, features.rows())));
     tSet.joinAll();
+    finishTraining(args);
+    for (auto& r : results) r.get(); // Rethrow the error of any thread, so the partially trained model is not saved
+
+    // Save training output
+    save(args, output);
+}
+
+void OnlineModel::onlineStreamTrainThread(int threadId, OnlineModel* model, DataStream& stream, Args& args) {
+    std::shared_ptr<DataBatch> batch;
+    try {
+        while ((batch = stream.next()) != nullptr) {
+            for (int r = 0; r < batch->features.rows(); ++r)
+                model->update(batch->epoch, batch->firstRow + r, batch->labels[r], batch->features[r], args);
+            model->flushUpdates(args); // Buffered updates point to the batch's features
+        }
+    } catch (...) {
+        while (stream.next() != nullptr); // Drain the stream, so the reader is not blocked on the full queue
+        throw;
+    }
+}
+
+void OnlineModel::trainOnStream(Args& args, std::string output) {
+    Log(CERR) << "Preparing online model ...\n";
+
+    // Init model, the number of labels and features is not known in advance
+    if(args.resume) load(args, output);
+    else init(args);
+
+    // Iterate over batches of rows
+    Log(CERR) << "Training online on data stream for " << args.epochs << " epochs in " << args.threads << " threads ...\n";
+
+    DataStream stream(args, args.epochs);
+    startTraining(args, output);
+    TaskSet tSet(args.threads);
+    std::vector<std::future<void>> results;
+    for (int t = 0; t < args.threads; ++t)
+        results.push_back(tSet.add(onlineStreamTrainThread, t, this, std::ref(stream), std::ref(args)));
+    tSet.joinAll();
+    stream.join();
+    finishTraining(args);
+    for (auto& r : results) r.get(); // Rethrow the error of any thread, so the partially trained model is not saved
+    Log(CERR) << "  Rows per epoch: " << stream.getRows() << "\n";
 
     // Save training output
     save(args, output);
@@ -23,18 +23,26 @@
 #pragma once
 
 #include "model.h"
+#include "read_data.h"
 
 
 class OnlineModel : virtual public Model {
 public:
     void train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) final;
+    void trainOnStream(Args& args, std::string output) final;
 
     virtual void init(Args& args) = 0;
     virtual void init(SRMatrix& labels, SRMatrix& features, Args& args) = 0;
     virtual void update(const int epoch, const int row, SparseVector& labels, SparseVector& features, Args& args) = 0;
     virtual void save(Args& args, std::string output) = 0;
+    virtual void flushUpdates(Args& args) {} // Apply updates buffered by the calling thread
+
+    // Called before the training threads start and after all of them finish
+    virtual void startTraining(Args& args, std::string output) {}
+    virtual void finishTraining(Args& args) {}
 
 private:
     static void onlineTrainThread(int threadId, OnlineModel* model, SRMatrix& labels,
                                   SRMatrix& features, Args& args, const int startRow, const int stopRow);
+    static void onlineStreamTrainThread(int threadId, OnlineModel* model, DataStream& stream, Args& args);
 };
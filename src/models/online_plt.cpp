@@ -22,10 +22,52 @@
 
 #include "online_plt.h"
 #include <cfloat>
+#include <filesystem>
 
 
+ConcurrentLeavesMap::ConcurrentLeavesMap(): chunks(new std::atomic<std::atomic<TreeNode*>*>[maxChunks]) {
+    for (size_t i = 0; i < maxChunks; ++i) chunks[i].store(nullptr, std::memory_order_relaxed);
+}
+
+ConcurrentLeavesMap::~ConcurrentLeavesMap() {
+    clear();
+}
+
+void ConcurrentLeavesMap::insert(int label, TreeNode* n) {
+    size_t c = static_cast<size_t>(label) >> chunkBits;
+    if (label < 0 || c >= maxChunks) throw std::invalid_argument("Label index out of range");
+    auto chunk = chunks[c].load(std::memory_order_relaxed);
+    if (chunk == nullptr) {
+        chunk = new std::atomic<TreeNode*>[chunkMask + 1];
+        for (size_t i = 0; i <= chunkMask; ++i) chunk[i].store(nullptr, std::memory_order_relaxed);
+        chunks[c].store(chunk, std::memory_order_release);
+    }
+    chunk[label & chunkMask].store(n, std::memory_order_release);
+}
+
+void ConcurrentLeavesMap::clear() {
+    for (size_t i = 0; i < maxChunks; ++i) {
+        delete[] chunks[i].load(std::memory_order_relaxed);
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+OnlinePLTSnapshot::OnlinePLTSnapshot(std::unique_ptr<LabelTree> snapshotTree, std::vector<Base*> snapshotBases) {
+    tree = std::move(snapshotTree);
+    bases = std::move(snapshotBases);
+    m = tree->labelsSize();
+    type = oplt;
+    name = "Online PLT snapshot";
+    loaded = true;
+}
+
 OnlinePLT::OnlinePLT() {
     onlineTree = true;
+    hogwildSize = 0;
+    childrenCapacity = 0;
+    training = false;
+    snapshotVersion = 0;
+    checkpointsCount = 0;
     type = oplt;
     name = "Online PLT";
 }
@@ -37,25 +79,29 @@ OnlinePLT::~OnlinePLT() {
 void OnlinePLT::init(Args& args) {
     tree = std::make_unique<LabelTree>();
     onlineTree = true;
+    prepareTree(args);
+    setupHogwild(args, 0);
 }
 
 void OnlinePLT::init(SRMatrix& labels, SRMatrix& features, Args& args) {
     tree = std::make_unique<LabelTree>();
+    setupHogwild(args, features.cols());
 
     if (args.treeType == onlineRandom || args.treeType == onlineBestScore) {
         onlineTree = true;
+        prepareTree(args);
     } else if (args.treeType == balancedRandom || args.treeType == balancedInOrder || args.treeType == hierarchicalKmeans){
         tree->buildTreeStructure(labels, features, args);
         onlineTree = false;
 
         bases.resize(tree->size());
         auxBases.resize(tree->size());
-        for (auto& b : bases) b = new Base(args);
+        for (auto& b : bases) b = createBase(args);
 
         size_t nonDummyAux = 0;
         for(const auto& n : tree->nodes){
             if(!n->children.empty() && std::any_of(n->children.begin(), n->children.end(),[](TreeNode* n){ return n->label >= 0; })){
-                auxBases[n->index] = new Base(args);
+                auxBases[n->index] = createBase(args);
                 ++nonDummyAux;
             }
             else auxBases[n->index] = new Base();
@@ -65,44 +111,394 @@ void OnlinePLT::init(SRMatrix& labels, SRMatrix& features, Args& args) {
     }
 }
 
+void OnlinePLT::prepareTree(Args& args){
+    childrenCapacity = std::max(args.arity, args.maxLeaves) + 1;
+
+    // Preallocate children of internal nodes (nulls are skipped while reading) and index the leaves
+    leavesMap.clear();
+    for (auto& n : tree->nodes) {
+        if (n->label < 0 && n->children.capacity() < childrenCapacity) {
+            std::vector<TreeNode*> children(std::max(childrenCapacity, n->children.size()), nullptr);
+            children.resize(n->children.size());
+            std::copy(n->children.begin(), n->children.end(), children.begin());
+            n->children.swap(children);
+        }
+        else if (n->label >= 0) leavesMap.insert(n->label, n);
+    }
+}
+
+Base* OnlinePLT::createBase(Args& args){
+    return new Base(args, hogwildSize);
+}
+
+void OnlinePLT::setupHogwild(Args& args, size_t featuresSize){
+    if (!args.hogwild) {
+        hogwildSize = 0;
+        return;
+    }
+
+    // Bias and LibLinear's 0 feature are included in features space
+    hogwildSize = std::max(featuresSize, static_cast<size_t>(args.hash ? args.hash + 2 : 0));
+
+    // When resuming, weights of the loaded bases also have to fit
+    auto fitWeights = [&](Base* b) {
+        if (b->getW() != nullptr)
+            b->getW()->forEachIV([&](const int& i, Real& v) { hogwildSize = std::max(hogwildSize, static_cast<size_t>(i) + 1); });
+    };
+    for (auto b : bases) fitWeights(b);
+    for (auto b : auxBases) fitWeights(b);
+
+    if (hogwildSize == 0)
+        throw std::invalid_argument("Hogwild training requires fixed features space, use --hash option");
+
+    for (auto b : bases) if (!b->isDummy()) b->toDense(hogwildSize);
+    for (auto b : auxBases) if (!b->isDummy()) b->toDense(hogwildSize);
+    Log(CERR) << "  Hogwild updates, size of preallocated weights: " << hogwildSize << "\n";
+}
+
 void OnlinePLT::update(const int epoch, const int row, SparseVector& labels, SparseVector& features, Args& args) {
+    // Features are sorted, so it is enough to check the last index
+    if (hogwildSize && features.nonZero() && static_cast<size_t>(features.data()[features.nonZero() - 1].index) >= hogwildSize)
+        throw std::invalid_argument("Feature index is out of range of preallocated weights, use --hash option");
+
     UnorderedSet<TreeNode *> nPositive;
     UnorderedSet<TreeNode *> nNegative;
-    if (epoch == 0 && onlineTree) { // Check if example contains a new label
-        std::vector<int> newLabels;
+    const bool concurrent = onlineTree && args.threads > 1;
 
-        if(args.threads == 1) {
-            for (auto &l : labels)
-                if (!tree->leaves.count(l.index)) newLabels.push_back(l.index);
+    if (onlineTree) { // Check if example contains a new label
+        std::vector<int> newLabels;
+        for (auto &l : labels)
+            if (!leavesMap.find(l.index)) newLabels.push_back(l.index);
 
-            if (!newLabels.empty()) // Expand tree in case of the new label
-                expandTree(newLabels, features, args);
-        } else {
-            {
-                std::shared_lock<std::shared_timed_mutex> lock(treeMtx);
-                for (auto &l : labels)
-                    if (!tree->leaves.count(l.index)) newLabels.push_back(l.index);
-            }
+        if (!newLabels.empty()) { // Expand tree in case of the new label
+            std::lock_guard<std::mutex> lock(expandMtx);
 
-            if (!newLabels.empty()) { // Expand tree in case of the new label
-                std::unique_lock<std::shared_timed_mutex> lock(treeMtx);
+            // Some of the labels could be added by other thread in the meantime
+            newLabels.erase(std::remove_if(newLabels.begin(), newLabels.end(),
+                                           [&](int l){ return leavesMap.find(l) != nullptr; }), newLabels.end());
+            if (!newLabels.empty()) {
+                SeqLockWriteGuard writeGuard(treeSeqLock);
                 expandTree(newLabels, features, args);
             }
         }
     }
 
     // Update positive, negative and aux base estimators
-    if(epoch == 0 && onlineTree && args.threads > 1) {
-        std::shared_lock<std::shared_timed_mutex> lock(treeMtx);
-        getNodesToUpdate(nPositive, nNegative, labels);
+    if (concurrent) {
+        size_t version;
+        do {
+            nPositive.clear();
+            nNegative.clear();
+            version = treeSeqLock.readBegin();
+            getNodesToUpdateConcurrent(nPositive, nNegative, labels);
+        } while (treeSeqLock.readRetry(version));
     }
     else getNodesToUpdate(nPositive, nNegative, labels);
 
+    std::shared_lock<BigReaderLock> basesLockGuard(basesLock, std::defer_lock);
+    if (concurrent) basesLockGuard.lock();
+
+    if (args.miniBatch > 1) {
+        if (miniBatchBuffer.owner != this) {
+            miniBatchBuffer.updates.clear();
+            miniBatchBuffer.examples = 0;
+            miniBatchBuffer.owner = this;
+        }
+
+        for (const auto &n : nPositive){
+            bufferUpdate(bases[n->index], 1.0, features.data());
+            if (!auxBases[n->index]->isDummy()) bufferUpdate(auxBases[n->index], 0.0, features.data());
+        }
+        for (const auto &n : nNegative) bufferUpdate(bases[n->index], 0.0, features.data());
+
+        if (basesLockGuard.owns_lock()) basesLockGuard.unlock();
+        if (++miniBatchBuffer.examples >= args.miniBatch) flushUpdates(args);
+        return;
+    }
+
     for (const auto &n : nPositive){
-        bases[n->index]->update(1.0, features.data(), args);
-        if (!auxBases[n->index]->isDummy()) auxBases[n->index]->update(0.0, features.data(), args);
+        updateBase(bases[n->index], 1.0, features.data(), args);
+        if (!auxBases[n->index]->isDummy()) updateBase(auxBases[n->index], 0.0, features.data(), args);
+    }
+    for (const auto &n : nNegative) updateBase(bases[n->index], 0.0, features.data(), args);
+    updatesCount.add(1);
+}
+
+thread_local OnlinePLT::MiniBatchBuffer OnlinePLT::miniBatchBuffer;
+
+void OnlinePLT::flushUpdates(Args& args) {
+    if (miniBatchBuffer.owner != this) return;
+
+    for (auto& u : miniBatchBuffer.updates) {
+        if (hogwildSize) u.first->unsafeUpdateBatch(u.second, args);
+        else u.first->updateBatch(u.second, args);
+    }
+    updatesCount.add(miniBatchBuffer.examples);
+    miniBatchBuffer.updates.clear();
+    miniBatchBuffer.examples = 0;
+}
+
+void OnlinePLT::startTraining(Args& args, std::string output) {
+    updatesCount.clear();
+    snapshotVersion = 0;
+    training = true;
+    if (args.snapshotInterval > 0)
+        snapshotThread.start(args.snapshotInterval, [this, &args](){ publishSnapshot(args); });
+
+    if (args.checkpointInterval > 0) {
+        if (!args.resume) removeCheckpoints(output); // Left by the previous training
+        checkpointedNodes.clear();
+        for (size_t i = 0; i < bases.size(); ++i) checkpointedNodes.push_back(getNodeState(bases[i], auxBases[i]));
+        checkpointThread.start(args.checkpointInterval, [this, &args, output](){ checkpoint(args, output); });
+    }
+}
+
+void OnlinePLT::finishTraining(Args& args) {
+    checkpointThread.stop();
+    snapshotThread.stop();
+    training = false;
+    std::atomic_store(&snapshot, std::shared_ptr<PLT>());
+}
+
+void OnlinePLT::publishSnapshot(Args& args) {
+    std::lock_guard<std::mutex> publishLock(publishMtx);
+
+    // Nothing changed since the last snapshot, read before copying, so updates applied during the copy make it stale
+    size_t version = updatesCount.sum();
+    if (std::atomic_load(&snapshot) != nullptr && version == snapshotVersion) return;
+
+    auto snapshotTree = std::make_unique<LabelTree>();
+    std::vector<Base*> basesToCopy;
+
+    {
+        // Expansions are serialized by expandMtx, so the copied tree is complete,
+        // bases vector also grows only during expansion
+        std::lock_guard<std::mutex> lock(expandMtx);
+        if (tree->root == nullptr) return;
+
+        size_t size = tree->nodes.size();
+        for (size_t i = 0; i < size; ++i) snapshotTree->createTreeNode();
+        for (size_t i = 0; i < size; ++i) {
+            TreeNode* n = tree->nodes[i];
+            TreeNode* sn = snapshotTree->nodes[i];
+            snapshotTree->setLabel(sn, n->label);
+            sn->subtreeLeaves = n->subtreeLeaves;
+            for (auto& child : n->children) // Children of internal nodes are preallocated
+                if (child != nullptr) snapshotTree->setParent(snapshotTree->nodes[child->index], sn);
+        }
+        snapshotTree->root = snapshotTree->nodes[tree->root->index];
+        basesToCopy.assign(bases.begin(), bases.begin() + size);
+    }
+
+    // Weights are copied without blocking the expansion, each base is locked only for the time of its copy
+    std::vector<Base*> snapshotBases;
+    snapshotBases.reserve(basesToCopy.size());
+    for (auto b : basesToCopy) snapshotBases.push_back(b->copyForPrediction(args));
+
+    std::atomic_store(&snapshot, std::shared_ptr<PLT>(new OnlinePLTSnapshot(std::move(snapshotTree), std::move(snapshotBases))));
+    snapshotVersion = version;
+    Log(CERR_DEBUG) << "  Published snapshot of " << basesToCopy.size() << " nodes\n";
+}
+
+std::shared_ptr<PLT> OnlinePLT::getSnapshot(Args& args) {
+    if (!training) return nullptr;
+    auto s = std::atomic_load(&snapshot);
+
+    // Without periodic publishing, the snapshot is refreshed on demand if the model was updated since it was copied
+    if (s == nullptr || (args.snapshotInterval <= 0 && updatesCount.sum() != snapshotVersion)) {
+        publishSnapshot(args);
+        s = std::atomic_load(&snapshot);
+    }
+    return s;
+}
+
+void OnlinePLT::predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) {
+    if (!training) return PLT::predict(prediction, features, args);
+    auto s = getSnapshot(args);
+    if (s != nullptr) s->predict(prediction, features, args); // No snapshot if the tree is still empty
+}
+
+Real OnlinePLT::predictForLabel(Label label, SparseVector& features, Args& args) {
+    if (!training) return PLT::predictForLabel(label, features, args);
+    auto s = getSnapshot(args);
+    return (s != nullptr) ? s->predictForLabel(label, features, args) : 0;
+}
+
+std::vector<Real> OnlinePLT::predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) {
+    if (!training) return PLT::predictForLabels(labels, features, args);
+    auto s = getSnapshot(args);
+    return (s != nullptr) ? s->predictForLabels(labels, features, args) : std::vector<Real>(labels.size(), 0);
+}
+
+std::vector<std::vector<Prediction>> OnlinePLT::predictBatch(SRMatrix& features, Args& args) {
+    if (!training) return PLT::predictBatch(features, args);
+    auto s = getSnapshot(args); // The same snapshot for the whole batch
+    if (s != nullptr) return s->predictBatch(features, args);
+    return std::vector<std::vector<Prediction>>(features.rows());
+}
+
+std::string OnlinePLT::getCheckpointFile(const std::string& dir, int number) {
+    return joinPath(dir, "checkpoint_" + std::to_string(number) + ".bin");
+}
+
+void OnlinePLT::checkpoint(Args& args, const std::string& output) {
+    // Delta file format: number of nodes, for each node its label, number of leaves in the subtree and children,
+    // the root index, then the number of changed nodes, and the index, base and aux base of each of them
+    std::vector<int> labels;
+    std::vector<int> subtreeLeaves;
+    std::vector<std::vector<int>> children;
+    std::vector<Base*> nodesBases;
+    std::vector<Base*> nodesAuxBases;
+    int rootIndex;
+
+    {
+        // Expansions are serialized by expandMtx, so the tree is complete, updates are not blocked
+        std::lock_guard<std::mutex> lock(expandMtx);
+        if (tree->root == nullptr) return;
+
+        size_t size = tree->nodes.size();
+        labels.reserve(size);
+        subtreeLeaves.reserve(size);
+        children.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            TreeNode* n = tree->nodes[i];
+            labels.push_back(n->label);
+            subtreeLeaves.push_back(n->subtreeLeaves);
+            for (auto& child : n->children) // Children of internal nodes are preallocated
+                if (child != nullptr) children[i].push_back(child->index);
+        }
+        rootIndex = tree->root->index;
+        nodesBases.assign(bases.begin(), bases.begin() + size);
+        nodesAuxBases.assign(auxBases.begin(), auxBases.begin() + size);
+    }
+
+    int size = labels.size();
+    std::vector<int> changed;
+    std::vector<std::tuple<int, int, bool>> states;
+    states.reserve(size);
+    for (int i = 0; i < size; ++i) {
+        states.push_back(getNodeState(nodesBases[i], nodesAuxBases[i]));
+        if (i >= checkpointedNodes.size() || states[i] != checkpointedNodes[i]) changed.push_back(i);
+    }
+    if (changed.empty()) return;
+
+    // Write to temporary file first, so the interrupted checkpoint doesn't leave a broken delta
+    std::string file = getCheckpointFile(output, checkpointsCount + 1);
+    std::string tmpFile = file + ".tmp";
+    std::ofstream out(tmpFile, std::ios::out | std::ios::binary);
+    saveVar(out, size);
+    for (int i = 0; i < size; ++i) {
+        int childrenCount = children[i].size();
+        saveVar(out, labels[i]);
+        saveVar(out, subtreeLeaves[i]);
+        saveVar(out, childrenCount);
+        for (auto& c : children[i]) saveVar(out, c);
+    }
+    saveVar(out, rootIndex);
+
+    int changedCount = changed.size();
+    saveVar(out, changedCount);
+    for (auto i : changed) {
+        saveVar(out, i);
+        for (auto b : {nodesBases[i], nodesAuxBases[i]}) {
+            // Base is locked only for the time of copying, the copy is fully regularized,
+            // so the replayed base restarts lazy regularization without the steps
+            Base* c = b->copy();
+            c->finalizeRegularization(args);
+            c->save(out, true);
+            delete c;
+        }
+    }
+    out.close();
+    std::filesystem::rename(tmpFile, file);
+
+    ++checkpointsCount;
+    checkpointedNodes = std::move(states);
+    Log(CERR_DEBUG) << "  Checkpoint " << checkpointsCount << ": " << changedCount << "/" << size << " nodes changed\n";
+}
+
+void OnlinePLT::replayCheckpoints(Args& args, const std::string& infile) {
+    int number = 0;
+    while (std::filesystem::exists(getCheckpointFile(infile, number + 1))) {
+        ++number;
+        std::ifstream in(getCheckpointFile(infile, number), std::ios::in | std::ios::binary);
+
+        // Rebuild the tree
+        int size;
+        loadVar(in, size);
+        tree->clear();
+        for (int i = 0; i < size; ++i) tree->createTreeNode();
+        for (int i = 0; i < size; ++i) {
+            TreeNode* n = tree->nodes[i];
+            int label, childrenCount;
+            loadVar(in, label);
+            loadVar(in, n->subtreeLeaves);
+            loadVar(in, childrenCount);
+            tree->setLabel(n, label);
+            for (int c = 0; c < childrenCount; ++c) {
+                int childIndex;
+                loadVar(in, childIndex);
+                tree->setParent(tree->nodes[childIndex], n);
+            }
+        }
+        int rootIndex;
+        loadVar(in, rootIndex);
+        tree->root = tree->nodes[rootIndex];
+
+        // Replace bases of changed nodes
+        bases.resize(size, nullptr);
+        auxBases.resize(size, nullptr);
+        int changedCount;
+        loadVar(in, changedCount);
+        for (int i = 0; i < changedCount; ++i) {
+            int index;
+            loadVar(in, index);
+            for (auto b : {&bases[index], &auxBases[index]}) {
+                if (*b == nullptr) *b = new Base();
+                (*b)->load(in, true);
+                (*b)->resumeOnlineTraining(args);
+            }
+        }
+        if (!in.good()) throw std::invalid_argument("Failed to read checkpoint: " + getCheckpointFile(infile, number));
+    }
+
+    if (number) {
+        for (size_t i = 0; i < bases.size(); ++i)
+            if (bases[i] == nullptr || auxBases[i] == nullptr)
+                throw std::invalid_argument("Checkpoints are incomplete, node " + std::to_string(i) + " is missing");
+        m = tree->labelsSize();
+        Log(CERR) << "Replayed checkpoints: " << number << ", tree size: " << tree->nodes.size() << "\n";
+    }
+    checkpointsCount = number;
+}
+
+void OnlinePLT::removeCheckpoints(const std::string& dir) {
+    for (int number = 1; std::filesystem::exists(getCheckpointFile(dir, number)); ++number)
+        remove(getCheckpointFile(dir, number));
+    checkpointsCount = 0;
+}
+
+void OnlinePLT::getNodesToUpdateConcurrent(UnorderedSet<TreeNode*>& nPositive, UnorderedSet<TreeNode*>& nNegative,
+                                           const SparseVector& labels) {
+    // Tree can be modified during the traversal, the result is validated by the caller,
+    // so it only has to be safe to read, nodes are never deleted
+    for (auto &l : labels) {
+        TreeNode* n = leavesMap.find(l.index);
+        while (n != nullptr && nPositive.insert(n).second) n = n->parent;
+    }
+
+    TreeNode* root = tree->root;
+    if (nPositive.empty()) {
+        if (root != nullptr) nNegative.insert(root);
+        return;
+    }
+
+    for(auto& n : nPositive) {
+        for (const auto &child : n->children) {
+            if (child != nullptr && !nPositive.count(child))
+                nNegative.insert(child);
+        }
     }
-    for (const auto &n : nNegative) bases[n->index]->update(0.0, features.data(), args);
 }
 
 void OnlinePLT::save(Args& args, std::string output) {
@@ -124,6 +520,7 @@ void OnlinePLT::save(Args& args, std::string output) {
     size = bases.size();
     out.write((char*)&size, sizeof(size));
     for (int i = 0; i < size; ++i) {
+        if (auxBases[i]->isDummy()) auxBases[i]->setDummy(); // Free weights kept for hogwild updates
         auxBases[i]->finalizeOnlineTraining(args);
         auxBases[i]->save(out, args.saveGrads);
     }
@@ -134,26 +531,61 @@ void OnlinePLT::save(Args& args, std::string output) {
 
     // Save tree structure
     tree->saveTreeStructure(joinPath(output, "tree.txt"));
+
+    // Checkpoints are no longer needed when the model is saved
+    removeCheckpoints(output);
 }
 
 void OnlinePLT::load(Args& args, std::string infile){
-    PLT::load(args, infile);
+    if (args.resume && !std::filesystem::exists(joinPath(infile, "weights.bin"))) {
+        // Training was interrupted before the model was saved, it can be recovered only from checkpoints
+        tree = std::make_unique<LabelTree>();
+        onlineTree = true;
+    } else {
+        PLT::load(args, infile);
+        if (args.resume) {
+            auxBases = loadBases(joinPath(infile, "aux_weights.bin"), args.resume, args.loadAs);
+            for (auto b : bases) b->resumeOnlineTraining(args);
+            for (auto b : auxBases) b->resumeOnlineTraining(args);
+        }
+    }
 
     if(args.resume){
-        auxBases = loadBases(joinPath(infile, "aux_weights.bin"), args.resume, args.loadAs);
+        replayCheckpoints(args, infile);
         assert(bases.size() == auxBases.size());
+        prepareTree(args);
+        setupHogwild(args, 0);
     }
 
     loaded = true;
 }
 
-TreeNode* OnlinePLT::createTreeNode(TreeNode* parent, int label, Base* base, Base* auxBase){
-    auto n = tree->createTreeNode(parent, label);
-    n->subtreeLeaves = 0;
+TreeNode* OnlinePLT::createTreeNode(TreeNode* parent, int label, Base* base, Base* auxBase, size_t childrenToReserve){
+    if (!treeSeqLock.isWriting()) treeSeqLock.writeBegin(); // Ended by the write guard of the expansion in update
 
+    // Grow bases only when no other thread is reading them
+    if (bases.size() == bases.capacity()) {
+        std::lock_guard<BigReaderLock> lock(basesLock);
+        size_t newCapacity = std::max<size_t>(1024, 2 * bases.capacity());
+        bases.reserve(newCapacity);
+        auxBases.reserve(newCapacity);
+    }
     bases.push_back(base);
     auxBases.push_back(auxBase);
 
+    // Node is fully set up before it is attached to the tree
+    auto n = new TreeNode();
+    n->index = tree->nodes.size();
+    n->subtreeLeaves = 0;
+    if (label < 0) {
+        n->children.resize(std::max(childrenCapacity, childrenToReserve), nullptr);
+        n->children.clear();
+    }
+    tree->nodes.push_back(n);
+    tree->setLabel(n, label);
+    tree->setParent(n, parent);
+    if (label >= 0) leavesMap.insert(label, n);
+
     return n;
 }
 
@@ -165,12 +597,12 @@ void OnlinePLT::expandTree(const std::vector<Label>& newLabels, SparseVector& fe
     std::uniform_int_distribution<uint32_t> dist(0, args.arity - 1);
 
     if (tree->nodes.empty()) // Empty tree
-        tree->root = createTreeNode(nullptr, -1, new Base(args), new Base());  // Root node doesn't need aux classifier
+        tree->root = createTreeNode(nullptr, -1, createBase(args), new Base());  // Root node doesn't need aux classifier
 
     if (tree->root->children.size() < args.arity) {
-        TreeNode* newGroup = createTreeNode(tree->root, -1, new Base(args), new Base(args)); // Group node needs aux classifier
+        TreeNode* newGroup = createTreeNode(tree->root, -1, createBase(args), createBase(args), newLabels.size()); // Group node needs aux classifier
         for(const auto nl : newLabels)
-            createTreeNode(newGroup, nl, new Base(args), new Base());
+            createTreeNode(newGroup, nl, createBase(args), new Base());
         newGroup->subtreeLeaves += newLabels.size();
         tree->root->subtreeLeaves += newLabels.size();
         return;
@@ -194,7 +626,7 @@ void OnlinePLT::expandTree(const std::vector<Label>& newLabels, SparseVector& fe
             TreeNode *bestChild = toExpand->children[0];
 
             for (auto &child : toExpand->children) {
-                Real prob = bases[child->index]->predictProbability(features);
+                Real prob = bases[child->index]->lockedPredictProbability(features);
                 Real score = (1.0 - alpha) * prob + alpha * std::log(
                     (static_cast<Real>(toExpand->subtreeLeaves) / toExpand->children.size()) / child->subtreeLeaves);
                 if (score > bestScore) {
@@ -248,11 +680,11 @@ void OnlinePLT::expandTree(const std::vector<Label>& newLabels, SparseVector& fe
             newParentOfChildren->subtreeLeaves = toExpand->subtreeLeaves;
 
             // Create new branch with new node
-            auto newBranch = createTreeNode(toExpand, -1, auxBases[toExpand->index]->copy(), new Base(args));
+            auto newBranch = createTreeNode(toExpand, -1, auxBases[toExpand->index]->copy(), createBase(args));
             createTreeNode(newBranch, nl, auxBases[toExpand->index]->copy(), new Base());
 
             // "Remove" (set as dummy) aux classifier
-            if (toExpand->children.size() >= args.arity) auxBases[toExpand->index]->setDummy();
+            if (toExpand->children.size() >= args.arity) auxBases[toExpand->index]->setDummy(!hogwildSize);
 
             toExpand->subtreeLeaves += newLabels.size() - li;
             toExpand = newBranch;
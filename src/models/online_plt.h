@@ -24,9 +24,50 @@
 
 #include "online_model.h"
 #include "plt.h"
+#include "threads.h"
 
+#include <atomic>
+#include <climits>
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <tuple>
+
+
+// Label -> leaf map that can be read concurrently without locking,
+// two-level, so the table grows without moving already published entries, writers have to be serialized externally
+class ConcurrentLeavesMap {
+public:
+    ConcurrentLeavesMap();
+    ~ConcurrentLeavesMap();
+
+    inline TreeNode* find(int label) const {
+        size_t c = static_cast<size_t>(label) >> chunkBits;
+        if (label < 0 || c >= maxChunks) return nullptr;
+        auto chunk = chunks[c].load(std::memory_order_acquire);
+        if (chunk == nullptr) return nullptr;
+        return chunk[label & chunkMask].load(std::memory_order_acquire);
+    }
+    void insert(int label, TreeNode* n);
+    void clear();
+
+private:
+    static const size_t chunkBits = 16;
+    static const size_t chunkMask = (1 << chunkBits) - 1;
+    static const size_t maxChunks = (static_cast<size_t>(INT_MAX) >> chunkBits) + 1;
+
+    std::unique_ptr<std::atomic<std::atomic<TreeNode*>*>[]> chunks;
+};
+
+
+// Read-only copy of Online PLT's tree and base classifiers, published for prediction during training
+class OnlinePLTSnapshot : public PLT {
+public:
+    OnlinePLTSnapshot(std::unique_ptr<LabelTree> snapshotTree, std::vector<Base*> snapshotBases);
+
+    void train(SRMatrix& labels, SRMatrix& features, Args& args, std::string output) override {
+        throw std::invalid_argument("Snapshot of Online PLT model cannot be trained");
+    }
+};
 
 
 class OnlinePLT : public OnlineModel, public PLT {
@@ -37,16 +78,88 @@ public:
     void init(Args& args) override;
     void init(SRMatrix& labels, SRMatrix& features, Args& args) override;
     void update(const int epoch, const int row, SparseVector& labels, SparseVector& features, Args& args) override;
+    void flushUpdates(Args& args) override;
+    void startTraining(Args& args, std::string output) override;
+    void finishTraining(Args& args) override;
+
+    // During training, prediction uses the latest published snapshot, it is published on demand if there is none
+    void predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) override;
+    Real predictForLabel(Label label, SparseVector& features, Args& args) override;
+    std::vector<Real> predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) override;
+    std::vector<std::vector<Prediction>> predictBatch(SRMatrix& features, Args& args) override;
+
+    bool isTraining() override { return training; };
+    void publishSnapshot(Args& args);
+    std::shared_ptr<PLT> getSnapshot(Args& args); // nullptr if the model is not being trained
+
+    void checkpoint(Args& args, const std::string& output);
 
     void save(Args& args, std::string output) override;
     void load(Args& args, std::string infile) override;
 
 protected:
     bool onlineTree;
+    size_t hogwildSize; // Size of preallocated dense weights, 0 if hogwild updates are disabled
 
     std::vector<Base*> auxBases; // Aux classifiers
-    std::shared_timed_mutex treeMtx;
 
-    TreeNode* createTreeNode(TreeNode* parent = nullptr, int label = -1, Base* base = nullptr, Base* auxBase = nullptr);
+    // Concurrent tree growth: expansions are serialized by expandMtx, while other threads look up leaves
+    // without locking and collect nodes to update under seqlock, retrying if the tree was modified in the meantime.
+    // The children of internal nodes are preallocated, so they are never moved while being read,
+    // bases vectors are locked exclusively only when they have to grow.
+    ConcurrentLeavesMap leavesMap;
+    std::mutex expandMtx;
+    SeqLock treeSeqLock;
+    BigReaderLock basesLock;
+    size_t childrenCapacity;
+
+    // Snapshots for prediction while training, the tree is copied under expandMtx, so it is never half-expanded,
+    // readers keep the snapshot alive as long as they use it, the last one frees it.
+    // The snapshot remembers the number of applied updates it was copied after, so the stale one is republished
+    std::shared_ptr<PLT> snapshot;
+    ShardedCounter updatesCount;
+    std::atomic<size_t> snapshotVersion;
+    std::atomic<bool> training;
+    std::mutex publishMtx;
+    PeriodicThread snapshotThread;
+
+    // Incremental checkpoints, each one is a delta file with the current tree structure and only the bases
+    // of nodes changed since the previous checkpoint, they are replayed on resume and removed when the model is saved
+    PeriodicThread checkpointThread;
+    int checkpointsCount;
+    std::vector<std::tuple<int, int, bool>> checkpointedNodes; // Updates of base and aux base, and if aux is dummy
+
+    static inline std::tuple<int, int, bool> getNodeState(Base* base, Base* auxBase){
+        return {base->getUpdatesCount(), auxBase->getUpdatesCount(), auxBase->isDummy()};
+    }
+    static std::string getCheckpointFile(const std::string& dir, int number);
+    void replayCheckpoints(Args& args, const std::string& infile);
+    void removeCheckpoints(const std::string& dir);
+
+    void prepareTree(Args& args);
+    void getNodesToUpdateConcurrent(UnorderedSet<TreeNode*>& nPositive, UnorderedSet<TreeNode*>& nNegative,
+                                    const SparseVector& labels);
+
+    Base* createBase(Args& args);
+    void setupHogwild(Args& args, size_t featuresSize);
+    inline void updateBase(Base* base, Real label, Feature* features, Args& args){
+        if (hogwildSize) base->unsafeUpdate(label, features, args); // Races between threads are tolerated
+        else base->update(label, features, args);
+    }
+
+    // Mini-batch updates: examples are buffered per base in each thread and applied in one merged step,
+    // bases are never deleted during training, so the buffer can keep pointers to them
+    struct MiniBatchBuffer {
+        OnlinePLT* owner = nullptr;
+        int examples = 0;
+        UnorderedMap<Base*, std::vector<std::pair<Real, Feature*>>> updates;
+    };
+    static thread_local MiniBatchBuffer miniBatchBuffer;
+    inline void bufferUpdate(Base* base, Real label, Feature* features){
+        miniBatchBuffer.updates[base].emplace_back(label, features);
+    }
+
+    TreeNode* createTreeNode(TreeNode* parent = nullptr, int label = -1, Base* base = nullptr, Base* auxBase = nullptr,
+                             size_t childrenToReserve = 0);
     void expandTree(const std::vector<Label>& newLabels, SparseVector& features, Args& args);
 };
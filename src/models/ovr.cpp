@@ -36,7 +36,7 @@ OVR::OVR() {
     name = "OVR";
 }
 
-void OVR::assignDataPoints(std::vector<std::vector<Real>>& binLabels, std::vector<Feature*>& binFeatures, std::vector<Real>& binWeights,
+void OVR::assignDataPoints(std::vector<std::vector<int>>& binPositives, std::vector<Feature*>& binFeatures, std::vector<Real>& binWeights,
                           SRMatrix& labels, SRMatrix& features, int rStart, int rStop, Args& args){
     int rows = labels.rows();
     for (int r = 0; r < rows; ++r) {
@@ -51,19 +51,19 @@ void OVR::assignDataPoints(std::vector<std::vector<Real>>& binLabels, std::vecto
         for (int i = 0; i < rSize; ++i){
             binFeatures.push_back(features[r].data());
             binWeights.push_back(1.0 / rSize);
-            for (auto &bl: binLabels) bl.push_back(0);
-            if (rLabels[i] >= rStart && rLabels[i] < rStop) binLabels[rLabels[i] - rStart].back() = 1;
+            if (rLabels[i] >= rStart && rLabels[i] < rStop) binPositives[rLabels[i] - rStart].push_back(binFeatures.size() - 1);
         }
     }
 }
 
 std::vector<Prediction> OVR::predictForAllLabels(SparseVector& features, Args& args) {
     std::vector<Prediction> prediction;
-    prediction.reserve(bases.size());
+    auto& localBases = getLocalBases(bases);
+    prediction.reserve(localBases.size());
     Real sum = 0;
 
-    for (int i = 0; i < bases.size(); ++i) {
-        Real value = exp(bases[i]->predictValue(features)); // Softmax normalization
+    for (int i = 0; i < localBases.size(); ++i) {
+        Real value = exp(localBases[i]->predictValue(features)); // Softmax normalization
         sum += value;
         prediction.emplace_back(i, value);
     }
@@ -73,11 +73,12 @@ std::vector<Prediction> OVR::predictForAllLabels(SparseVector& features, Args& a
 }
 
 Real OVR::predictForLabel(Label label, SparseVector& features, Args& args) {
+    auto& localBases = getLocalBases(bases);
     Real sum = 0;
-    for (int i = 0; i < bases.size(); ++i) {
-        Real value = exp(bases[i]->predictValue(features)); // Softmax normalization
+    for (int i = 0; i < localBases.size(); ++i) {
+        Real value = exp(localBases[i]->predictValue(features)); // Softmax normalization
         sum += value;
     }
 
-    return exp(bases[label]->predictValue(features)) / sum;
+    return exp(localBases[label]->predictValue(features)) / sum;
 }
@@ -31,7 +31,7 @@ public:
     Real predictForLabel(Label label, SparseVector& features, Args& args) override;
 
 protected:
-    void assignDataPoints(std::vector<std::vector<Real>>& binLabels,
+    void assignDataPoints(std::vector<std::vector<int>>& binPositives,
                           std::vector<Feature*>& binFeatures,
                           std::vector<Real>& binWeights,
                           SRMatrix& labels, SRMatrix& features,
@@ -24,6 +24,7 @@
 #include <cassert>
 #include <climits>
 #include <cmath>
+#include <filesystem>
 #include <list>
 #include <utility>
 #include <vector>
@@ -41,10 +42,12 @@ PLT::PLT() {
 }
 
 void PLT::unload() {
+    clearBasesReplicas();
     for (auto b : bases) delete b;
     bases.clear();
     bases.shrink_to_fit();
     tree = nullptr;
+    nodeCache = nullptr;
     Model::unload();
 }
 
@@ -261,6 +264,8 @@ void PLT::predict(std::vector<Prediction>& prediction, SparseVector& features, A
             return prob * nodesWeights[node->index].value + nodesBiases[node->index].value;
         };
 
+    if (nodeCache) NodeCache::setFeatures(features);
+
     // Predict for root
     Real rootProb = predictForNode(tree->root, features);
     addToQueue(ifAddToQueue, calculateValue, nQueue, tree->root, rootProb);
@@ -292,55 +297,73 @@ Prediction PLT::predictNextLabel(
     return {-1, 0};
 }
 
-void PLT::calculateNodesLabels(){
-    if(!tree) throw std::runtime_error("Tree is not constructed, load or build a tree first");
+void LabelsSegmentTree::build(const std::vector<Real>& values, const std::vector<int>& labelsOrder){
+    size = labelsOrder.size();
+    t.assign(2 * size, empty());
+    for (int i = 0; i < size; ++i) {
+        int l = labelsOrder[i];
+        if (l < values.size()) t[size + i] = {values[l], l};
+    }
+    for (int i = size - 1; i > 0; --i) t[i] = better(t[2 * i], t[2 * i + 1]);
+}
 
-    if(tree->size() != nodesLabels.size()){
-        nodesLabels.clear();
-        nodesLabels.resize(tree->size());
+void LabelsSegmentTree::update(int position, int label, Real value){
+    int i = size + position;
+    t[i] = {value, label};
+    for (i /= 2; i > 0; i /= 2) t[i] = better(t[2 * i], t[2 * i + 1]);
+}
 
-        for (auto& l : tree->leaves) {
-            TreeNode* n = l.second;
-            while (n != nullptr) {
-                nodesLabels[n->index].push_back(l.first);
-                n = n->parent;
-            }
-        }
+TreeNodeValueExt LabelsSegmentTree::query(int begin, int end) const {
+    TreeNodeValueExt result = empty();
+    for (begin += size, end += size; begin < end; begin /= 2, end /= 2) {
+        if (begin & 1) result = better(result, t[begin++]);
+        if (end & 1) result = better(result, t[--end]);
     }
+    return result;
 }
 
-void PLT::setNodeThreshold(TreeNode* n){
+void PLT::calculateLabelsOrder(){
     if(!tree) throw std::runtime_error("Tree is not constructed, load or build a tree first");
 
-    TreeNodeValueExt& nTh = nodesThr[n->index];
-    nTh.value = std::numeric_limits<Real>::min();
-    for (auto &l : nodesLabels[n->index]) {
-        if (thresholds[l] < nTh.value) {
-            nTh.value = thresholds[l];
-            nTh.label = l;
+    if(tree->size() != nodesRanges.size()){
+        nodesRanges.assign(tree->size(), {0, 0});
+        labelsOrder.clear();
+        labelsPositions.clear();
+
+        // Preorder DFS, labels of each subtree form a continuous range
+        std::vector<TreeNode*> nStack;
+        std::vector<TreeNode*> preorder;
+        nStack.push_back(tree->root);
+        while (!nStack.empty()) {
+            TreeNode* n = nStack.back();
+            nStack.pop_back();
+            preorder.push_back(n);
+            nodesRanges[n->index].first = labelsOrder.size();
+            if (n->label >= 0) {
+                if (n->label >= labelsPositions.size()) labelsPositions.resize(n->label + 1, -1);
+                labelsPositions[n->label] = labelsOrder.size();
+                labelsOrder.push_back(n->label);
+            }
+            for (auto c = n->children.rbegin(); c != n->children.rend(); ++c) nStack.push_back(*c);
         }
-    }
-}
 
-void PLT::setNodeWeight(TreeNode* n){
-    TreeNodeValueExt& nW = nodesWeights[n->index];
-    nW.value = std::numeric_limits<Real>::min();
-    for (auto &l : nodesLabels[n->index]) {
-        if (labelsWeights[l] > nW.value) {
-            nW.value = labelsWeights[l];
-            nW.label = l;
-        }
+        // Ends of the ranges, children are always after their parent in preorder
+        for (auto n : preorder) nodesRanges[n->index].second = nodesRanges[n->index].first + (n->label >= 0 ? 1 : 0);
+        for (auto n = preorder.rbegin(); n != preorder.rend(); ++n)
+            if ((*n)->parent) {
+                auto& pRange = nodesRanges[(*n)->parent->index];
+                pRange.second = std::max(pRange.second, nodesRanges[(*n)->index].second);
+            }
     }
 }
 
-void PLT::setNodeBias(TreeNode* n){
-    TreeNodeValueExt& nB = nodesBiases[n->index];
-    nB.value = std::numeric_limits<Real>::max();
-    for (auto &l : nodesLabels[n->index]) {
-        if (labelsBiases[l] > nB.value) {
-            nB.value = labelsBiases[l];
-            nB.label = l;
-        }
+void PLT::setNodesValues(std::vector<TreeNodeValueExt>& nodesValues, LabelsSegmentTree& valuesTree, const std::vector<Real>& values){
+    calculateLabelsOrder();
+    valuesTree.build(values, labelsOrder);
+    nodesValues.resize(tree->size());
+    for (auto& n : tree->nodes) {
+        auto& range = nodesRanges[n->index];
+        nodesValues[n->index] = valuesTree.query(range.first, range.second);
     }
 }
 
@@ -348,44 +371,40 @@ void PLT::setThresholds(std::vector<Real> th){
     if(!tree) throw std::runtime_error("Tree is not constructed, load or build a tree first");
 
     Model::setThresholds(std::move(th));
-    calculateNodesLabels();
-    if (tree->size() != nodesThr.size()) nodesThr.resize(tree->size());
-    for (auto& n : tree->nodes) setNodeThreshold(n);
+    setNodesValues(nodesThr, thresholdsTree, thresholds);
 }
 
 void PLT::setLabelsWeights(std::vector<Real> lw){
     if(!tree) throw std::runtime_error("Tree is not constructed, load or build a tree first");
 
     Model::setLabelsWeights(std::move(lw));
-    calculateNodesLabels();
-    if (tree->size() != nodesWeights.size()) nodesWeights.resize(tree->size());
-    for (auto& n : tree->nodes) setNodeWeight(n);
+    setNodesValues(nodesWeights, weightsTree, labelsWeights);
+    if (nodesBiases.size() != tree->size()) setNodesValues(nodesBiases, biasesTree, labelsBiases);
 }
 
 void PLT::setLabelsBiases(std::vector<Real> lb){
     if(!tree) throw std::runtime_error("Tree is not constructed, load or build a tree first");
 
     Model::setLabelsBiases(lb);
-    calculateNodesLabels();
-    if (tree->size() != nodesBiases.size()) nodesBiases.resize(tree->size());
-    for (auto& n : tree->nodes) setNodeBias(n);
+    setNodesValues(nodesBiases, biasesTree, labelsBiases);
+    if (nodesWeights.size() != tree->size()) setNodesValues(nodesWeights, weightsTree, labelsWeights);
 }
 
 void PLT::updateThresholds(UnorderedMap<int, Real> thToUpdate){
-    for(auto& th : thToUpdate)
+    for(auto& th : thToUpdate){
         thresholds[th.first] = th.second;
 
-    for(auto& th : thToUpdate){
-        TreeNode* n = tree->leaves[th.first];
-        TreeNodeValueExt& nTh = nodesThr[n->index];
-        while(n != tree->root){
-            if(th.second < nTh.value){
-                nTh.value = th.second;
-                nTh.label = th.first;
-            } else if (th.first == nTh.label && th.second > nTh.value){
-                setNodeThreshold(n);
-            }
-            n = n->parent;
+        auto l = tree->leaves.find(th.first);
+        if (l == tree->leaves.end()) continue;
+        thresholdsTree.update(labelsPositions[th.first], th.first, th.second);
+
+        // Minimum of the subtree changes only if it changed for the child, so the update can stop early
+        for (TreeNode* n = l->second; n != nullptr; n = n->parent) {
+            auto& range = nodesRanges[n->index];
+            TreeNodeValueExt nTh = thresholdsTree.query(range.first, range.second);
+            TreeNodeValueExt& oldNTh = nodesThr[n->index];
+            if (nTh.value == oldNTh.value && nTh.label == oldNTh.label) break;
+            oldNTh = nTh;
         }
     }
 }
@@ -393,13 +412,10 @@ void PLT::updateThresholds(UnorderedMap<int, Real> thToUpdate){
 Real PLT::predictForLabel(Label label, SparseVector& features, Args& args) {
     auto fn = tree->leaves.find(label);
     if(fn == tree->leaves.end()) return 0;
-    TreeNode* n = fn->second;
-    Real value = bases[n->index]->predictProbability(features);
-    while (n->parent) {
-        n = n->parent;
-        value *= predictForNode(n, features);
-        ++nodeEvaluationCount;
-    }
+    if (nodeCache) NodeCache::setFeatures(features);
+    Real value = 1;
+    for (TreeNode* n = fn->second; n != nullptr; n = n->parent)
+        value *= predictForNodeOnPath(n, features);
 
     if(!labelsWeights.empty())
         value *= labelsWeights[label];
@@ -407,6 +423,49 @@ Real PLT::predictForLabel(Label label, SparseVector& features, Args& args) {
     return value;
 }
 
+std::vector<Real> PLT::predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) {
+    // Paths of the labels share their upper parts, so products of probabilities
+    // on the paths from the root are remembered for all the visited nodes
+    UnorderedMap<TreeNode*, Real> pathValues;
+    std::vector<TreeNode*> path;
+    std::vector<Real> values;
+    values.reserve(labels.size());
+    if (nodeCache) NodeCache::setFeatures(features);
+
+    for (const auto& label : labels) {
+        auto fn = tree->leaves.find(label);
+        if (fn == tree->leaves.end()) {
+            values.push_back(0);
+            continue;
+        }
+
+        // Go up to the first node with known value
+        Real value = 1;
+        path.clear();
+        for (TreeNode* n = fn->second; n != nullptr; n = n->parent) {
+            auto pv = pathValues.find(n);
+            if (pv != pathValues.end()) {
+                value = pv->second;
+                break;
+            }
+            path.push_back(n);
+        }
+
+        // And back down to the leaf
+        for (auto n = path.rbegin(); n != path.rend(); ++n) {
+            value *= predictForNodeOnPath(*n, features);
+            pathValues[*n] = value;
+        }
+
+        if(!labelsWeights.empty())
+            value *= labelsWeights[label];
+
+        values.push_back(value);
+    }
+
+    return values;
+}
+
 void PLT::preload(Args& args, std::string infile){
     tree = std::make_unique<LabelTree>();
     tree->loadFromFile(joinPath(infile, "tree.bin"));
@@ -418,11 +477,23 @@ void PLT::load(Args& args, std::string infile) {
 
     Log::updateGlobalIndent(2);
     preload(args, infile);
-    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
+    {
+        NumaBind numaBind(args.numa ? 0 : -1); // Original bases are placed on the first node
+        bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
+    }
+    std::string profileFile = joinPath(infile, "nodes_profile.txt");
+    if (args.profileMemLimit > 0 && std::filesystem::exists(profileFile))
+        assignRepresentations(loadNodesProfile(profileFile), args);
+    replicateBases(bases, args);
 
     assert(bases.size() == tree->nodes.size());
     m = tree->getNumberOfLeaves();
 
+    if (args.nodeCache > 0) {
+        nodeCache = std::make_unique<NodeCache>(args.nodeCache);
+        Log(CERR) << "Node cache size: " << nodeCache->getSize() << " (" << formatMem(nodeCache->mem()) << ")\n";
+    }
+
     loaded = true;
     Log::updateGlobalIndent(-2);
 }
@@ -435,11 +506,191 @@ void PLT::printInfo() {
         Log(COUT) << "  Updated estimators / data point: " << static_cast<Real>(nodeUpdateCount) / dataPointCount << "\n";
     if(nodeEvaluationCount > 0)
         Log(COUT) << "  Evaluated estimators / data point: " << static_cast<Real>(nodeEvaluationCount) / dataPointCount << "\n";
+    if(nodeCache && nodeCache->getLookups() > 0)
+        Log(COUT) << "  Node cache hit rate: " << static_cast<Real>(nodeCache->getHits()) / nodeCache->getLookups()
+                  << " (" << nodeCache->getHits() << " / " << nodeCache->getLookups() << ")\n";
+}
+
+void PLT::compact(Args& args, const std::string& infile, const std::string& outfile) {
+    copyModelFiles(infile, outfile, {"tree.bin", "tree.txt", "weights.bin", "aux_weights.bin", "nodes_profile.txt"});
+    preload(args, infile);
+    bases = loadBases(joinPath(infile, "weights.bin"));
+    compactBases(bases, args);
+
+    // Profile is indexed by nodes, so it has to follow them through collapsing and renumbering
+    std::string profileFile = joinPath(infile, "nodes_profile.txt");
+    UnorderedMap<TreeNode*, Real> nodesProfile;
+    if (std::filesystem::exists(profileFile)) {
+        try {
+            auto profile = loadNodesProfile(profileFile);
+            for (auto n : tree->nodes) nodesProfile[n] = profile[n->index];
+        } catch (std::invalid_argument& e) {
+            Log(CERR) << "Warning: " << e.what() << ", it is not copied to the compacted model!\n";
+        }
+    }
+
+    Log(CERR) << "Collapsing single-child chains ...\n";
+    size_t nodesBefore = tree->nodes.size();
+    UnorderedMap<TreeNode*, Base*> nodesBases;
+    for (auto n : tree->nodes) nodesBases[n] = bases[n->index];
+    int collapsed = collapseSingleChildChains();
+
+    // Nodes are renumbered level by level, so bases of siblings are stored and loaded next to each other
+    tree->reenumerateNodes();
+    bases.clear();
+    for (auto n : tree->nodes) {
+        bases.push_back(nodesBases[n]);
+        nodesBases.erase(n);
+    }
+    for (auto& nb : nodesBases) delete nb.second;
+    Log(CERR) << "Collapsed nodes: " << collapsed << ", tree size: " << nodesBefore << " -> " << tree->nodes.size() << "\n";
+
+    tree->saveToFile(joinPath(outfile, "tree.bin"));
+    tree->saveTreeStructure(joinPath(outfile, "tree.txt"));
+    saveBases(joinPath(outfile, "weights.bin"), bases);
+
+    if (!nodesProfile.empty()) {
+        std::vector<Real> profile;
+        profile.reserve(tree->nodes.size());
+        for (auto n : tree->nodes) profile.push_back(nodesProfile[n]);
+        saveNodesProfile(profile, joinPath(outfile, "nodes_profile.txt"));
+    }
+    unload();
+}
+
+void PLT::profile(SRMatrix& features, Args& args, const std::string& infile) {
+    Log(CERR) << "Profiling nodes evaluations on " << features.rows() << " data points ...\n";
+
+    // Exact search evaluates nodes one by one, so they can be counted
+    Args profileArgs = args;
+    profileArgs.treeSearchType = exact;
+    nodesEvaluations = std::vector<std::atomic<int>>(tree->nodes.size());
+    predictBatch(features, profileArgs);
+
+    std::vector<Real> nodesProfile(tree->nodes.size());
+    int neverEvaluated = 0;
+    Real evaluated = 0;
+    for (int i = 0; i < nodesProfile.size(); ++i) {
+        nodesProfile[i] = static_cast<Real>(nodesEvaluations[i]) / features.rows();
+        evaluated += nodesProfile[i];
+        if (nodesEvaluations[i] == 0) ++neverEvaluated;
+    }
+    nodesEvaluations.clear();
+
+    std::string profileFile = joinPath(infile, "nodes_profile.txt");
+    saveNodesProfile(nodesProfile, profileFile);
+    Log(CERR) << "Evaluated nodes / data point: " << evaluated << ", never evaluated nodes: " << neverEvaluated
+              << "/" << nodesProfile.size() << "\n  Profile saved to: " << profileFile << "\n";
+}
+
+void PLT::saveNodesProfile(const std::vector<Real>& nodesProfile, const std::string& outfile) {
+    std::ofstream out(outfile);
+    out << tree->nodes.size() << " " << tree->checksum() << "\n";
+    for (auto v : nodesProfile) out << v << "\n";
+    out.close();
+}
+
+std::vector<Real> PLT::loadNodesProfile(const std::string& infile) {
+    std::ifstream in(infile);
+    size_t treeSize, treeChecksum;
+    if (!(in >> treeSize >> treeChecksum) || treeSize != tree->nodes.size() || treeChecksum != tree->checksum())
+        throw std::invalid_argument("Nodes profile " + infile + " was collected for a different tree, run profile command again");
+
+    std::vector<Real> nodesProfile;
+    nodesProfile.reserve(treeSize);
+    Real v;
+    while (in >> v) nodesProfile.push_back(v);
+    if (nodesProfile.size() != treeSize)
+        throw std::invalid_argument("Nodes profile " + infile + " is incomplete, run profile command again");
+
+    return nodesProfile;
+}
+
+void PLT::assignRepresentations(const std::vector<Real>& nodesProfile, Args& args) {
+    Log(CERR) << "Assigning representations of base classifiers using nodes profile ...\n";
+
+    unsigned long long mem = 0;
+    int cold = 0;
+    for (int i = 0; i < bases.size(); ++i) {
+        AbstractVector* w = bases[i]->getW();
+        if (nodesProfile[i] == 0 && w != nullptr && w->type() != sparse) {
+            bases[i]->to(sparse);
+            ++cold;
+        }
+        mem += bases[i]->mem();
+    }
+
+    // The most often evaluated nodes first
+    std::vector<int> order(bases.size());
+    for (int i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return nodesProfile[a] > nodesProfile[b]; });
+
+    int hot = 0;
+    for (auto i : order) {
+        AbstractVector* w = bases[i]->getW();
+        if (nodesProfile[i] == 0) break;
+        if (w == nullptr || w->type() == dense) continue;
+        unsigned long long denseMem = Vector::estimateMem(w->size(), w->nonZero());
+        unsigned long long currentMem = bases[i]->mem();
+        if (mem + denseMem - currentMem > args.profileMemLimit) continue;
+        bases[i]->to(dense);
+        mem += bases[i]->mem() - currentMem;
+        ++hot;
+    }
+
+    Log(CERR) << "Dense hot classifiers: " << hot << ", sparse cold classifiers: " << cold
+              << ", base classifiers size: " << formatMem(mem) << "\n";
+}
+
+TreeNode* PLT::nodeToCollapse(TreeNode* parent, TreeNode* child) {
+    // Dummy base that always predicts positive class just passes the probability of its parent
+    auto isPassThrough = [&](TreeNode* n) {
+        Base* b = bases[n->index];
+        return b->isDummy() && b->getFirstClass() == 1;
+    };
+
+    if (isPassThrough(child) && (child->label < 0 || parent->label < 0)) return child;
+    if (isPassThrough(parent) && parent->label < 0) return parent;
+    return nullptr;
+}
+
+int PLT::collapseSingleChildChains() {
+    int collapsed = 0;
+    std::vector<TreeNode*> nStack = {tree->root};
+    while (!nStack.empty()) {
+        TreeNode* n = nStack.back();
+        nStack.pop_back();
+
+        while (n->children.size() == 1) {
+            TreeNode* c = n->children[0];
+            TreeNode* toRemove = nodeToCollapse(n, c);
+            if (toRemove == c) { // Parent takes children and label of the child
+                n->children = c->children;
+                for (auto cc : n->children) cc->parent = n;
+                if (c->label >= 0) tree->setLabel(n, c->label);
+                c->children.clear();
+                c->parent = nullptr;
+            } else if (toRemove == n) { // Child takes place of the parent
+                TreeNode* p = n->parent;
+                c->parent = p;
+                if (p != nullptr) std::replace(p->children.begin(), p->children.end(), n, c);
+                else tree->root = c;
+                n->children.clear();
+                n->parent = nullptr;
+                n = c;
+            } else break;
+            ++collapsed;
+        }
+
+        for (auto c : n->children) nStack.push_back(c);
+    }
+
+    return collapsed;
 }
 
 void PLT::buildTree(SRMatrix& labels, SRMatrix& features, Args& args, const std::string& output){
     tree = std::make_unique<LabelTree>();
-    tree->buildTreeStructure(labels, features, args);
+    tree->buildTreeStructure(labels, features, args, labelsFeatures);
 
     m = tree->getNumberOfLeaves();
     tree->saveToFile(joinPath(output, "tree.bin"));
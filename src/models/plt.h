@@ -22,9 +22,15 @@
 
 #pragma once
 
+#include <atomic>
+#include <limits>
+#include <utility>
+#include <vector>
+
 #include "base.h"
 #include "label_tree.h"
 #include "model.h"
+#include "node_cache.h"
 
 // Additional node information for prediction with thresholds/weights/etc
 struct TreeNodeValueExt {
@@ -32,6 +38,31 @@ struct TreeNodeValueExt {
     int label;
 };
 
+// Segment tree over labels' values in DFS order of the tree leaves,
+// so the minimum/maximum value of labels in any subtree is found in O(log n)
+class LabelsSegmentTree {
+public:
+    LabelsSegmentTree(bool max): max(max), size(0) {};
+
+    void build(const std::vector<Real>& values, const std::vector<int>& labelsOrder);
+    void update(int position, int label, Real value);
+    TreeNodeValueExt query(int begin, int end) const; // Range [begin, end)
+
+private:
+    bool max;
+    int size;
+    std::vector<TreeNodeValueExt> t;
+
+    inline TreeNodeValueExt empty() const {
+        return {max ? std::numeric_limits<Real>::lowest() : std::numeric_limits<Real>::max(), -1};
+    }
+
+    inline const TreeNodeValueExt& better(const TreeNodeValueExt& a, const TreeNodeValueExt& b) const {
+        if (max) return (b.value > a.value) ? b : a;
+        return (b.value < a.value) ? b : a;
+    }
+};
+
 
 // This is virtual class for all PLT based models: HSM, Batch PLT, Online PLT
 class PLT : virtual public Model {
@@ -41,6 +72,7 @@ public:
 
     void predict(std::vector<Prediction>& prediction, SparseVector& features, Args& args) override;
     Real predictForLabel(Label label, SparseVector& features, Args& args) override;
+    std::vector<Real> predictForLabels(const std::vector<Label>& labels, SparseVector& features, Args& args) override;
     std::vector<std::vector<Prediction>> predictBatch(SRMatrix& features, Args& args) override;
     std::vector<std::vector<Prediction>> predictWithBeamSearch(SRMatrix& features, Args& args);
 
@@ -53,10 +85,13 @@ public:
     void unload() override;
 
     void printInfo() override;
+    void compact(Args& args, const std::string& infile, const std::string& outfile) override;
+    void profile(SRMatrix& features, Args& args, const std::string& infile) override;
 
     void setTree(std::unique_ptr<LabelTree> t) { tree = std::move(t); };
     LabelTree* getTree() { return tree.get(); };
     bool isTreeLoaded() { return (tree != nullptr); };
+    void setLabelsFeatures(SRMatrix* lf) { labelsFeatures = lf; };
     void preload(Args& args, std::string infile) override;
 
     // Helpers for Python PLT Framework
@@ -70,16 +105,36 @@ public:
 protected:
     std::unique_ptr<LabelTree> tree;
     std::vector<Base*> bases;
+    SRMatrix* labelsFeatures = nullptr; // Precomputed labels' features for building k-means tree, not owned
+    std::unique_ptr<NodeCache> nodeCache; // Optional cache of nodes' probabilities, used only by loaded model
+    std::vector<std::atomic<int>> nodesEvaluations; // Evaluations of each node, counted only while profiling
+
+    // Hot nodes from the profile get dense weights within the memory limit, never evaluated get sparse ones
+    void assignRepresentations(const std::vector<Real>& nodesProfile, Args& args);
+
+    // Nodes profile is saved together with size and checksum of the tree it was collected for
+    void saveNodesProfile(const std::vector<Real>& nodesProfile, const std::string& outfile);
+    std::vector<Real> loadNodesProfile(const std::string& infile);
+
+    // Leaves in DFS order, labels of node's subtree are in range [nodesRanges[i].first, nodesRanges[i].second)
+    std::vector<int> labelsOrder;
+    std::vector<int> labelsPositions;
+    std::vector<std::pair<int, int>> nodesRanges;
+    LabelsSegmentTree thresholdsTree{false};
+    LabelsSegmentTree weightsTree{true};
+    LabelsSegmentTree biasesTree{true};
+
+    std::vector<TreeNodeValueExt> nodesThr; // For prediction with thresholds, minimum of labels' thresholds in subtree
+    std::vector<TreeNodeValueExt> nodesWeights; // For prediction with labels weights, maximum of labels' weights in subtree
+    std::vector<TreeNodeValueExt> nodesBiases; // For prediction with labels weights, maximum of labels' biases in subtree
 
-    std::vector<std::vector<int>> nodesLabels;
-    std::vector<TreeNodeValueExt> nodesThr; // For prediction with thresholds
-    std::vector<TreeNodeValueExt> nodesWeights; // For prediction with labels weights
-    std::vector<TreeNodeValueExt> nodesBiases; // For prediction with labels weights
+    // Node of single-child chain (parent with only one child) that can be removed without changing the model,
+    // nullptr if none
+    virtual TreeNode* nodeToCollapse(TreeNode* parent, TreeNode* child);
+    int collapseSingleChildChains();
 
-    void calculateNodesLabels();
-    void setNodeThreshold(TreeNode* n);
-    void setNodeWeight(TreeNode* n);
-    void setNodeBias(TreeNode* n);
+    void calculateLabelsOrder();
+    void setNodesValues(std::vector<TreeNodeValueExt>& nodesValues, LabelsSegmentTree& valuesTree, const std::vector<Real>& values);
 
     virtual void assignDataPoints(std::vector<std::vector<Real>>& binLabels,
                                   std::vector<std::vector<Feature*>>& binFeatures,
@@ -94,8 +149,26 @@ protected:
     virtual Prediction predictNextLabel(std::function<bool(TreeNode*, Real)>& ifAddToQueue, std::function<Real(TreeNode*, Real)>& calculateValue,
                                         TopKQueue<TreeNodeValue>& nQueue, SparseVector& features);
 
+    inline void countNodeEvaluation(TreeNode* node){
+        if (!nodesEvaluations.empty()) nodesEvaluations[node->index].fetch_add(1, std::memory_order_relaxed);
+    }
+
     virtual inline Real predictForNode(TreeNode* node, SparseVector& features){
-        return bases[node->index]->predictProbability(features);
+        countNodeEvaluation(node);
+        if (!nodeCache) return getLocalBases(bases)[node->index]->predictProbability(features);
+
+        Real value;
+        if (!nodeCache->get(features, node->index, value)) {
+            value = getLocalBases(bases)[node->index]->predictProbability(features);
+            nodeCache->put(features, node->index, value);
+        }
+        return value;
+    }
+
+    // Probability of the node given its parent, product of these on the path from the root gives label's probability
+    virtual inline Real predictForNodeOnPath(TreeNode* node, SparseVector& features){
+        ++nodeEvaluationCount;
+        return predictForNode(node, features);
     }
 
     inline void addToQueue(std::function<bool(TreeNode*, Real)>& ifAddToQueue, std::function<Real(TreeNode*, Real)>& calculateValue,
@@ -0,0 +1,149 @@
+/*
+ Copyright (c) 2021 by Marek Wydmuch
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "basic_types.h"
+#include "robin_hood.h"
+#include "vector.h"
+
+
+// Bounded cache of nodes' probabilities for repeated scoring of the same examples,
+// entries are keyed by 64-bit hash of features vector and node index.
+// It is direct-mapped and lock-free, colliding entries are just replaced. Each entry stores the full key
+// xor-ed with the value in one word and the value in the other, so the entry torn by concurrent writes is rejected.
+// The cache is lossy only in the sense of 64-bit hashes: two different (example, node) pairs with the same key
+// would share the value, which is as unlikely as a collision of two random 64-bit numbers.
+class NodeCache {
+public:
+    explicit NodeCache(size_t size): size(size), entries(new Entry[size]) {
+        clear();
+    }
+
+    void clear(){
+        for (size_t i = 0; i < size; ++i) {
+            entries[i].check.store(0, std::memory_order_relaxed);
+            entries[i].data.store(0, std::memory_order_relaxed);
+        }
+        for (auto& c : counters) {
+            c.hits.store(0, std::memory_order_relaxed);
+            c.lookups.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Hash of the features vector, the last one is remembered for each thread,
+    // call it for every new example, so the vector that reuses the memory is not mistaken for the previous one
+    static inline uint64_t setFeatures(const SparseVector& features){
+        last.begin = features.begin();
+        last.nonZero = features.nonZero();
+        last.hash = robin_hood::hash_bytes(features.begin(), features.nonZero() * sizeof(IRVPair));
+        return last.hash;
+    }
+
+    static inline uint64_t featuresHash(const SparseVector& features){
+        if (last.begin == features.begin() && last.nonZero == features.nonZero()) return last.hash;
+        return setFeatures(features);
+    }
+
+    inline bool get(const SparseVector& features, int nodeIndex, Real& value){
+        uint64_t key = nodeKey(features, nodeIndex);
+        Entry& e = entries[key % size];
+        uint64_t data = e.data.load(std::memory_order_relaxed);
+        uint64_t check = e.check.load(std::memory_order_relaxed);
+        bool hit = (data & validBit) && (check ^ data) == key;
+        if (hit) {
+            uint32_t bits = static_cast<uint32_t>(data);
+            std::memcpy(&value, &bits, sizeof(Real));
+        }
+
+        // Counters of the calling thread only, so threads do not contend on them
+        Counters& c = counters[getShard()];
+        c.lookups.store(c.lookups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (hit) c.hits.store(c.hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return hit;
+    }
+
+    inline void put(const SparseVector& features, int nodeIndex, Real value){
+        uint64_t key = nodeKey(features, nodeIndex);
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(Real));
+        uint64_t data = validBit | bits;
+        Entry& e = entries[key % size];
+        e.check.store(key ^ data, std::memory_order_relaxed);
+        e.data.store(data, std::memory_order_relaxed);
+    }
+
+    inline size_t getSize() const { return size; }
+    inline size_t mem() const { return size * sizeof(Entry) + sizeof(counters); }
+    inline unsigned long long getHits() const { return sumCounters(&Counters::hits); }
+    inline unsigned long long getLookups() const { return sumCounters(&Counters::lookups); }
+
+private:
+    static_assert(sizeof(Real) == sizeof(uint32_t), "NodeCache packs Real values into 32 bits");
+    static const uint64_t validBit = 1ULL << 32; // Empty entries are zeros, so they never pass the check
+
+    struct Entry {
+        std::atomic<uint64_t> check; // key ^ data
+        std::atomic<uint64_t> data;  // valid bit and value
+    };
+
+    struct LastFeatures {
+        const IRVPair* begin = nullptr;
+        size_t nonZero = 0;
+        uint64_t hash = 0;
+    };
+    static thread_local LastFeatures last;
+
+    // Statistics are sharded per thread, like in BigReaderLock, threads sharing a shard may lose some counts
+    static const size_t shardsCount = 64;
+    struct alignas(64) Counters {
+        std::atomic<unsigned long long> hits;
+        std::atomic<unsigned long long> lookups;
+    };
+    Counters counters[shardsCount];
+
+    static size_t getShard() {
+        static std::atomic<size_t> nextShard(0);
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % shardsCount;
+        return shard;
+    }
+
+    unsigned long long sumCounters(std::atomic<unsigned long long> Counters::* counter) const {
+        unsigned long long sum = 0;
+        for (auto& c : counters) sum += (c.*counter).load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    size_t size;
+    std::unique_ptr<Entry[]> entries;
+
+    static inline uint64_t nodeKey(const SparseVector& features, int nodeIndex){
+        return robin_hood::hash_int(featuresHash(features) ^ (static_cast<uint64_t>(nodeIndex) * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+inline thread_local NodeCache::LastFeatures NodeCache::last;
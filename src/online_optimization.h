@@ -20,50 +20,94 @@
  SOFTWARE.
  */
 
+#pragma once
+
+#include<algorithm>
 #include<cmath>
 
+#include "args.h"
+
 
-Real logisticLoss(Real label, Real pred, Real w){
+inline Real logisticLoss(Real label, Real pred, Real w){
     Real prob = (1.0 / (1.0 + std::exp(-pred)));
     return -label * std::log(prob) - (1 - label) * std::log(1 - prob);
 }
 
-Real logisticGrad(Real label, Real pred, Real w){
+inline Real logisticGrad(Real label, Real pred, Real w){
     return (1.0 / (1.0 + std::exp(-pred))) - label;
 }
 
-Real hingeGrad(Real label, Real pred, Real w){
+inline Real hingeGrad(Real label, Real pred, Real w){
     Real _label = 2 * label - 1;
     Real v = _label * pred;
     if(v > 1.0) return 0.0;
     else return -_label;
 }
 
-Real squaredHingeGrad(Real label, Real pred, Real w){
+inline Real squaredHingeGrad(Real label, Real pred, Real w){
     Real _label = 2 * label - 1;
     Real v = _label * pred;
     if(v > 1.0) return 0.0;
     else return -2 * std::max(1.0 - v, 0.0) * _label;
 }
 
-Real unbiasedLogisticLoss(Real label, Real pred, Real w){
+inline Real unbiasedLogisticLoss(Real label, Real pred, Real w){
     Real prob = (1.0 / (1.0 + std::exp(-pred)));
     return -label * w * std::log(prob) - (1 - label * w) * std::log(1 - prob);
 }
 
-Real unbiasedLogisticGrad(Real label, Real pred, Real w){
+inline Real unbiasedLogisticGrad(Real label, Real pred, Real w){
     return 1 / (1 + std::exp(-pred)) - label * w;
 }
 
-Real pwLogisticLoss(Real label, Real pred, Real w){
+inline Real pwLogisticLoss(Real label, Real pred, Real w){
     Real prob = (1.0 / (1.0 + std::exp(-pred)));
     return -(2 * w - 1) * label * std::log(prob) - (1 - label) * std::log(1 - prob);
 }
 
-Real pwLogisticGrad(Real label, Real pred, Real w){
+inline Real pwLogisticGrad(Real label, Real pred, Real w){
     return -(2 * (label * w - label * 0.5) / (1.0 + std::exp(-pred))) - label + 1;
 }
 
+// Lazy (just-in-time) regularization, weights of features absent in an example are not touched,
+// the penalty for the skipped steps is applied in closed form when the feature appears again,
+// U keeps the step of the last update of each weight as an integer.
+// For a constant step size lr, k steps of w <- sign(w) * max(0, |w| * (1 - lr * l2) - lr * l1) give:
+inline Real lazyPenalty(Real w, Real lr, long long steps, Real l1, Real l2){
+    if (w == 0 || steps <= 0) return w;
+    Real c = std::max<Real>(0, 1 - lr * l2);
+    Real ck = (steps == 1) ? c : std::pow(c, static_cast<Real>(steps));
+    Real a = std::abs(w) * ck;
+    if (l1 > 0) a -= lr * l1 * ((c < 1) ? (1 - ck) / (1 - c) : steps);
+    return (a > 0) ? std::copysign(a, w) : 0;
+}
+
+// Step size used during the skipped steps, AdaGrad's rate doesn't change while the feature is absent,
+// for SGD it is the average of eta / sqrt(k) over the skipped steps
+template <typename T>
+inline Real lazyRate(T* G, int index, int lastStep, int t, Args& args){
+    if (args.optimizerType == adagrad) return args.eta * std::sqrt(1.0 / (args.adagradEps + G->at(index)));
+    return args.eta * 2 * (std::sqrt(static_cast<double>(t)) - std::sqrt(static_cast<double>(lastStep))) / (t - lastStep);
+}
+
+// Regularizes weights of the example's features and returns their dot product with the example
+template <typename T, typename S>
+Real regularizeLazilyAndDot(T& W, T& G, S& U, Feature* features, int t, Args& args){
+    Real val = 0;
+    Feature* f = features;
+    while (f->index != -1) {
+        int& u = U[f->index];
+        Real& w = W[f->index];
+        if (u < t) {
+            if (w != 0) w = lazyPenalty(w, lazyRate(&G, f->index, u, t, args), t - u, args.l1Penalty, args.l2Penalty);
+            u = t;
+        }
+        val += w * f->value;
+        ++f;
+    }
+    return val;
+}
+
 template <typename T>
 void updateSGD(T& W, T& G, Feature* features, Real grad, int t, Args& args){
     Real eta = args.eta;
@@ -82,12 +126,9 @@ void updateAdaGrad(T& W, T& G, Feature* features, Real grad, int t, Args& args){
     Feature* f = features;
     while (f->index != -1) {
         Real& g = G[f->index];
-        G[f->index] += f->value * f->value * grad * grad;
-        Real lr = eta * std::sqrt(1.0 / (eps + G[f->index]));
+        g += f->value * f->value * grad * grad;
+        Real lr = eta * std::sqrt(1.0 / (eps + g));
         W[f->index] -= lr * (grad * f->value);
         ++f;
-        // TODO: add correct regularization
-        //Real reg = l2 * W[f->index];
-        //W[f->index] -= lr * (grad * f->value + reg);
     }
 }
@@ -29,9 +29,15 @@
 
 
 DataReader::DataReader(Args& args) {
+    open(args);
+}
+
+// Opens the input file, reads the header and skips rows up to the start row
+void DataReader::open(Args& args) {
     if (args.input.empty())
         throw std::invalid_argument("Empty input path");
 
+    if (in.is_open()) in.close();
     in = std::ifstream(args.input);
     if (!in.is_open())
         throw std::invalid_argument("Cannot open input file: " + args.input);
@@ -67,7 +73,7 @@ DataReader::DataReader(Args& args) {
 }
 
 // Reads train/test data to sparse matrix
-bool DataReader::readData(SRMatrix& labels, SRMatrix& features, Args& args, int rows) {
+bool DataReader::readData(SRMatrix& labels, SRMatrix& features, Args& args, int rows, bool printInfo) {
     if (args.hash) hFeatures = args.hash;
 
     // Read data points
@@ -82,12 +88,14 @@ bool DataReader::readData(SRMatrix& labels, SRMatrix& features, Args& args, int
     }
     else if (rows >= 0) rowsToRead = rows;
 
-    if (rowsToRead > 0) Log(CERR) << "Reading " << rowsToRead << " rows ... \n";
-    else Log(CERR) << "Reading rows ... \n" << Log::newLine(2) << "?%\r";
+    if (printInfo) {
+        if (rowsToRead > 0) Log(CERR) << "Reading " << rowsToRead << " rows ... \n";
+        else Log(CERR) << "Reading rows ... \n" << Log::newLine(2) << "?%\r";
+    }
 
     do {
         // If the number of rows is know, print progress
-        if (rowsToRead > 0) printProgress(i, rowsToRead);
+        if (printInfo && rowsToRead > 0) printProgress(i, rowsToRead);
 
         lLabels.clear();
         lFeatures.clear();
@@ -138,7 +146,8 @@ bool DataReader::readData(SRMatrix& labels, SRMatrix& features, Args& args, int
     */
 
     // Print info about loaded data
-    Log(CERR) << "Loaded: rows: " << labels.rows() << ", features: " << features.cols() - 2
+    if (printInfo)
+        Log(CERR) << "Loaded: rows: " << labels.rows() << ", features: " << features.cols() - 2
               << ", labels: " << labels.cols() << "\n  Data size: " << formatMem(labels.mem() + features.mem()) << "\n";
 
     return lineRead; 
@@ -203,3 +212,105 @@ void DataReader::processLabelsVector(std::vector<IRVPair> &lLabels) {
 }
 
 
+
+
+DataStream::DataStream(Args& args, int epochs): args(args), epochs(epochs), rows(0), queue(args.threads + 1) {
+    batchRows = args.batchRows > 0 ? args.batchRows : 10000;
+    if (args.streamCache && epochs > 1) cachePath = joinPath(args.output, "stream_cache.bin");
+
+    Log(CERR) << "Streaming data in batches of " << batchRows << " rows";
+    if (!cachePath.empty()) Log(CERR) << ", caching it to " << cachePath;
+    Log(CERR) << " ...\n";
+
+    reader = std::thread(&DataStream::readBatches, this);
+}
+
+DataStream::~DataStream() {
+    queue.close();
+    if (reader.joinable()) reader.join();
+    if (!cachePath.empty()) std::remove(cachePath.c_str());
+}
+
+std::shared_ptr<DataBatch> DataStream::next() {
+    std::shared_ptr<DataBatch> batch;
+    if (!queue.pop(batch)) return nullptr;
+    return batch;
+}
+
+void DataStream::join() {
+    if (reader.joinable()) reader.join();
+    if (readerException) std::rethrow_exception(readerException);
+}
+
+// Raw binary format of the cache, faster to read than text and keeps explicit zeros
+void DataStream::saveRows(std::ofstream& out, SRMatrix& matrix) {
+    int rows = matrix.rows();
+    out.write((char*)&rows, sizeof(rows));
+    for (int r = 0; r < rows; ++r) {
+        int size = matrix[r].nonZero();
+        out.write((char*)&size, sizeof(size));
+        out.write((char*)matrix[r].data(), size * sizeof(IRVPair));
+    }
+}
+
+void DataStream::loadRows(std::ifstream& in, SRMatrix& matrix) {
+    int rows;
+    in.read((char*)&rows, sizeof(rows));
+    std::vector<IRVPair> row;
+    for (int r = 0; r < rows; ++r) {
+        int size;
+        in.read((char*)&size, sizeof(size));
+        row.resize(size);
+        in.read((char*)row.data(), size * sizeof(IRVPair));
+        matrix.appendRow(row);
+    }
+}
+
+void DataStream::readBatches() {
+    try {
+        std::ofstream cacheOut;
+        if (!cachePath.empty()) cacheOut.open(cachePath, std::ios::binary);
+
+        for (int e = 0; e < epochs; ++e) {
+            int epochRows = 0;
+            bool moreData = true;
+
+            // Read text input in the first epoch, or if there is no cache
+            if (e == 0 || cachePath.empty()) {
+                DataReader dataReader(args);
+                while (moreData) {
+                    auto batch = std::make_shared<DataBatch>();
+                    moreData = dataReader.readData(batch->labels, batch->features, args, batchRows, false);
+                    if (!batch->features.rows()) break;
+                    batch->epoch = e;
+                    batch->firstRow = epochRows;
+                    epochRows += batch->features.rows();
+
+                    if (cacheOut.is_open()) {
+                        saveRows(cacheOut, batch->labels);
+                        saveRows(cacheOut, batch->features);
+                    }
+                    if (!queue.push(batch)) return;
+                }
+                if (cacheOut.is_open()) cacheOut.close();
+            } else {
+                std::ifstream cacheIn(cachePath, std::ios::binary);
+                while (cacheIn.peek() != EOF) {
+                    auto batch = std::make_shared<DataBatch>();
+                    loadRows(cacheIn, batch->labels);
+                    loadRows(cacheIn, batch->features);
+                    batch->epoch = e;
+                    batch->firstRow = epochRows;
+                    epochRows += batch->features.rows();
+                    if (!queue.push(batch)) return;
+                }
+            }
+
+            if (e == 0) rows = epochRows;
+            Log(CERR_DEBUG) << "  Epoch " << e << ": " << epochRows << " rows read\n";
+        }
+    } catch (...) {
+        readerException = std::current_exception();
+    }
+    queue.close();
+}
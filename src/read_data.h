@@ -22,19 +22,25 @@
 
 #pragma once
 
+#include <exception>
+#include <fstream>
+#include <memory>
 #include <string>
+#include <thread>
 
 #include "args.h"
 #include "basic_types.h"
 #include "vector.h"
 #include "matrix.h"
+#include "threads.h"
 
 // Libsvm, XMLCRepo and numeric VW data reader
 class DataReader {
 public:
     DataReader(Args& args);
     virtual ~DataReader() { if(in.is_open()) in.close(); }; 
-    bool readData(SRMatrix& labels, SRMatrix& features, Args& args, int rows = -1);
+    void open(Args& args);
+    bool readData(SRMatrix& labels, SRMatrix& features, Args& args, int rows = -1, bool printInfo = true);
     static void readLine(std::string& line, std::vector<IRVPair>& lLabels, std::vector<IRVPair>& lFeatures);
 
     static void prepareFeaturesVector(std::vector<IRVPair> &lFeatures, Real bias = 1.0);
@@ -51,3 +57,40 @@ private:
     int hRows;
     std::string line;
 };
+
+
+// Batch of rows read by DataStream
+struct DataBatch {
+    SRMatrix labels;
+    SRMatrix features;
+    int epoch;
+    int firstRow; // Index of the first row of the batch in the input
+};
+
+// Reads input in batches of rows in a background thread for streaming (out-of-core) training,
+// the input file (or its binary cache) is read again for every epoch
+class DataStream {
+public:
+    DataStream(Args& args, int epochs = 1);
+    ~DataStream();
+
+    std::shared_ptr<DataBatch> next(); // Blocks until the next batch is ready, returns nullptr after the last epoch
+    void join(); // Waits for the reader thread, rethrows its exception if any
+
+    inline int getRows() const { return rows; }; // Number of rows read in the first epoch
+
+private:
+    Args& args;
+    int epochs;
+    int batchRows;
+    int rows;
+    std::string cachePath;
+
+    BlockingQueue<std::shared_ptr<DataBatch>> queue;
+    std::thread reader;
+    std::exception_ptr readerException;
+
+    void readBatches();
+    static void saveRows(std::ofstream& out, SRMatrix& matrix);
+    static void loadRows(std::ifstream& in, SRMatrix& matrix);
+};
@@ -25,6 +25,11 @@
 #include "resources.h"
 
 #include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 
 #if defined(__linux__) || defined(__APPLE__)
@@ -112,4 +117,96 @@ unsigned long long getSystemMemory() {
 #endif
 
     return mem;
-}
\ No newline at end of file
+}
+std::vector<int> parseCpuList(const std::string& cpuList) {
+    std::vector<int> cpus;
+    std::stringstream ss(cpuList);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        range.erase(0, range.find_first_not_of(" \t\n"));
+        range.erase(range.find_last_not_of(" \t\n") + 1);
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+        for (int c = first; c <= last; ++c) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> getNumaNodes(const std::string& sysNodePath) {
+    std::vector<std::vector<int>> nodes;
+
+    std::ifstream onlineIn(sysNodePath + "/online");
+    if (!onlineIn.is_open()) return nodes;
+    std::string line;
+    std::getline(onlineIn, line);
+
+    try {
+        for (auto n : parseCpuList(line)) {
+            std::ifstream cpuListIn(sysNodePath + "/node" + std::to_string(n) + "/cpulist");
+            if (!cpuListIn.is_open()) continue;
+            std::getline(cpuListIn, line);
+            auto cpus = parseCpuList(line);
+            if (!cpus.empty()) nodes.push_back(cpus); // Skip memory-only nodes
+        }
+    } catch (const std::exception& e) { // Malformed sysfs, treat as unknown topology
+        nodes.clear();
+    }
+
+    return nodes;
+}
+
+bool getThreadAffinity(std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return false;
+    cpus.clear();
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &set)) cpus.push_back(c);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool setThreadAffinity(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto c : cpus)
+        if (c < CPU_SETSIZE) CPU_SET(c, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+static thread_local int threadNumaNode = -1;
+
+static const std::vector<std::vector<int>>& getNumaTopology() {
+    static const std::vector<std::vector<int>> nodes = getNumaNodes();
+    return nodes;
+}
+
+NumaBind::NumaBind(int node): prevNode(threadNumaNode), bound(false) {
+    const auto& nodes = getNumaTopology();
+    if (node < 0 || nodes.size() < 2) return;
+
+    node %= nodes.size();
+    if (getThreadAffinity(prevCpus) && setThreadAffinity(nodes[node])) {
+        threadNumaNode = node;
+        bound = true;
+    }
+}
+
+NumaBind::~NumaBind() {
+    if (!bound) return;
+    setThreadAffinity(prevCpus);
+    threadNumaNode = prevNode;
+}
+
+int NumaBind::numaNodes() { return getNumaTopology().size(); }
+
+int NumaBind::currentNode() { return threadNumaNode; }
@@ -20,10 +20,14 @@
  SOFTWARE.
  */
 
+#pragma once
+
 // Time & resources utils
 
 #include <chrono>
+#include <string>
 #include <thread>
+#include <vector>
 
 
 struct Resources {
@@ -47,3 +51,30 @@ int getCpuCount();
 
 // Returns size of available RAM
 unsigned long long getSystemMemory();
+
+// NUMA utils, the topology is read from sysfs, so it does not require libnuma
+
+// Returns CPUs of every NUMA node with CPUs, empty vector if the topology is not available
+std::vector<std::vector<int>> getNumaNodes(const std::string& sysNodePath = "/sys/devices/system/node");
+
+// Parses sysfs list format, e.g. "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string& cpuList);
+
+// Gets/sets CPUs the calling thread can run on, returns false if it is not supported
+bool getThreadAffinity(std::vector<int>& cpus);
+bool setThreadAffinity(const std::vector<int>& cpus);
+
+// Binds the calling thread to the NUMA node for the lifetime of the object, node < 0 or a single-node machine means no-op
+class NumaBind {
+public:
+    NumaBind(int node);
+    ~NumaBind();
+
+    static int numaNodes(); // Number of NUMA nodes, cached
+    static int currentNode(); // NUMA node the calling thread is bound to, -1 if not bound
+
+private:
+    std::vector<int> prevCpus;
+    int prevNode;
+    bool bound;
+};
@@ -1,104 +1,307 @@
 /*
- * ThreadPool:
- * Copyright (c) 2012 by Jakob Progsch, Vaclav Zeman
+ * ThreadSet, WorkerPool, TaskSet, BlockingQueue:
+ * Copyright (c) 2018-2021 by Marek Wydmuch
  * All rights reserved.
- * https://github.com/progschj/ThreadPool
  *
- * ThreadSet:
- * Copyright (c) 2018 by Marek Wydmuch
- * All rights reserved.
+ * MPMCQueue is based on the bounded MPMC queue by Dmitry Vyukov:
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
  */
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 #include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
+#include <chrono>
 #include <future>
 #include <functional>
 #include <stdexcept>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <process.h>
+#endif
+
 
-// Simple pool of threads
-class ThreadPool {
+// Lock-free bounded multi-producer multi-consumer queue
+template<typename T>
+class MPMCQueue {
 public:
-    ThreadPool(size_t);
-    ~ThreadPool();
+    MPMCQueue(size_t capacity);
 
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
-    void stopAll();
+    bool push(T&& item); // Returns false if the queue is full
+    bool pop(T& item); // Returns false if the queue is empty
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+};
+
+template<typename T>
+MPMCQueue<T>::MPMCQueue(size_t capacity){
+    size_t size = 2;
+    while(size < capacity) size *= 2; // Capacity has to be a power of 2
+    buffer = std::unique_ptr<Cell[]>(new Cell[size]);
+    mask = size - 1;
+    for(size_t i = 0; i < size; ++i) buffer[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos.store(0, std::memory_order_relaxed);
+    dequeuePos.store(0, std::memory_order_relaxed);
+}
+
+template<typename T>
+bool MPMCQueue<T>::push(T&& item){
+    Cell* cell;
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for(;;){
+        cell = &buffer[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if(dif == 0){
+            if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if(dif < 0) return false;
+        else pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+    cell->data = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool MPMCQueue<T>::pop(T& item){
+    Cell* cell;
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    for(;;){
+        cell = &buffer[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        if(dif == 0){
+            if(dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if(dif < 0) return false;
+        else pos = dequeuePos.load(std::memory_order_relaxed);
+    }
+    item = std::move(cell->data);
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+
+// Task shared between TaskSet and WorkerPool, it is executed by whoever claims it first
+struct PoolTask {
+    PoolTask(std::function<void()> func): claimed(false), func(std::move(func)) {}
+
+    inline bool run(){
+        if(claimed.exchange(true, std::memory_order_acq_rel)) return false;
+        func();
+        return true;
+    }
+
+    std::atomic<bool> claimed;
+    std::function<void()> func;
+};
+
+
+// Process-wide pool of persistent worker threads, created lazily,
+// it grows to the total number of threads requested by the living TaskSets
+class WorkerPool {
+public:
+    static WorkerPool& getInstance();
+
+    ~WorkerPool();
+
+    void reserve(size_t threads);
+    void release(size_t threads);
+    void submit(std::shared_ptr<PoolTask> task);
 
 private:
-    // Keeps track of threads
+    WorkerPool();
+
+    MPMCQueue<std::shared_ptr<PoolTask>> queue;
     std::vector<std::thread> workers;
+    size_t requested;
+    std::mutex workersMtx;
 
-    // The task queue
-    std::queue<std::function<void()>> tasks;
+    // Sleeping workers
+    std::atomic<int> sleepers;
+    std::atomic<bool> stop;
+    std::mutex sleepMtx;
+    std::condition_variable sleepCv;
 
-    // Synchronization
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+    void workerLoop();
 };
 
-// The constructor just launches some number of workers
-inline ThreadPool::ThreadPool(size_t threads): stop(false){
-    for(size_t i = 0; i < threads; ++i)
-        workers.emplace_back([this]{
-                for(;;){
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-                    task();
-                }
-            }
-        );
+inline WorkerPool::WorkerPool(): queue(4096), requested(0), sleepers(0), stop(false) {}
+
+inline WorkerPool::~WorkerPool(){
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        stop = true;
+    }
+    sleepCv.notify_all();
+    for(auto& worker : workers) worker.join();
 }
 
-// The destructor joins all threads
-inline ThreadPool::~ThreadPool(){
-    stopAll();
+// Id of the current process, used to detect that the pool was inherited by a forked process
+inline long currentProcessId(){
+#if defined(__linux__) || defined(__APPLE__)
+    return static_cast<long>(getpid());
+#elif defined(_WIN32)
+    return static_cast<long>(_getpid());
+#else
+    return 0;
+#endif
 }
 
-// Add new work item to the pool
+inline WorkerPool& WorkerPool::getInstance(){
+    static std::mutex instanceMtx;
+    static std::unique_ptr<WorkerPool> instance;
+    static long instancePid = 0;
+
+    std::lock_guard<std::mutex> lock(instanceMtx);
+    if(!instance || instancePid != currentProcessId()){
+        // Threads are not copied to a forked process, so the inherited pool is abandoned there
+        if(instance) instance.release();
+        instance = std::unique_ptr<WorkerPool>(new WorkerPool());
+        instancePid = currentProcessId();
+    }
+    return *instance;
+}
+
+inline void WorkerPool::reserve(size_t threads){
+    std::lock_guard<std::mutex> lock(workersMtx);
+    requested += threads;
+    while(workers.size() < requested) workers.emplace_back(&WorkerPool::workerLoop, this);
+}
+
+inline void WorkerPool::release(size_t threads){
+    std::lock_guard<std::mutex> lock(workersMtx);
+    requested -= std::min(requested, threads);
+}
+
+inline void WorkerPool::submit(std::shared_ptr<PoolTask> task){
+    // If the queue is full, the submitting thread executes the task
+    if(!queue.push(std::move(task))){
+        task->run();
+        return;
+    }
+
+    // Pairs with the fence in workerLoop, so either the worker sees the task or the submitter sees the sleeper
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleepers.load(std::memory_order_relaxed) > 0){
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        sleepCv.notify_one();
+    }
+}
+
+inline void WorkerPool::workerLoop(){
+    std::shared_ptr<PoolTask> task;
+    for(;;){
+        // Spin for a moment before going to sleep, tasks usually come in bursts
+        for(int i = 0; i < 64 && !task; ++i){
+            if(!queue.pop(task)) std::this_thread::yield();
+        }
+
+        if(!task){
+            std::unique_lock<std::mutex> lock(sleepMtx);
+            sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while(!stop && !queue.pop(task)) sleepCv.wait(lock);
+            sleepers.fetch_sub(1);
+            if(!task) return; // Stopped
+        }
+
+        task->run();
+        task.reset();
+    }
+}
+
+
+// Set of tasks executed by the process-wide WorkerPool, it can be used in the same way as ThreadSet
+class TaskSet {
+public:
+    TaskSet(size_t threads); // Number of threads the set of tasks should run on
+    ~TaskSet();
+
+    template<class F, class... Args>
+    auto add(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+    void joinAll();
+
+private:
+    size_t threads;
+    std::vector<std::shared_ptr<PoolTask>> tasks;
+
+    // Completion of tasks
+    struct State {
+        int pending = 0;
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    std::shared_ptr<State> state;
+};
+
+inline TaskSet::TaskSet(size_t threads): threads(std::max<size_t>(threads, 1)), state(std::make_shared<State>()){
+    WorkerPool::getInstance().reserve(this->threads);
+}
+
+inline TaskSet::~TaskSet(){
+    joinAll();
+    WorkerPool::getInstance().release(threads);
+}
+
+// Add new task to the set
 template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>{
+auto TaskSet::add(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>{
     using return_type = typename std::result_of<F(Args...)>::type;
 
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
+    auto packagedTask = std::make_shared<std::packaged_task<return_type()>>(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...)
         );
 
-    std::future<return_type> res = task->get_future();
+    std::future<return_type> res = packagedTask->get_future();
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::lock_guard<std::mutex> lock(state->mtx);
+        ++state->pending;
+    }
 
-        // Don't allow enqueueing after stopping the pool
-        if(stop) throw std::runtime_error("Enqueue on stopped ThreadPool!");
+    auto taskState = state;
+    auto task = std::make_shared<PoolTask>([packagedTask, taskState](){
+        (*packagedTask)();
+        {
+            std::lock_guard<std::mutex> lock(taskState->mtx);
+            --taskState->pending;
+        }
+        taskState->cv.notify_all();
+    });
 
-        tasks.emplace([task](){ (*task)(); });
-    }
-    condition.notify_one();
+    tasks.push_back(task);
+    WorkerPool::getInstance().submit(task);
     return res;
 }
 
-inline void ThreadPool::stopAll(){
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
-    }
-    condition.notify_all();
-    for(std::thread &worker: workers) worker.join();
+inline void TaskSet::joinAll(){
+    // Help with own tasks that were not started yet, this also makes nested sets safe
+    for(auto& task : tasks) task->run();
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cv.wait(lock, [this]{ return state->pending == 0; });
+    tasks.clear();
 }
 
 
@@ -141,3 +344,199 @@ inline void ThreadSet::joinAll(){
         worker.join();
     workers.clear();
 }
+
+
+// Bounded queue for passing items between producer and consumer threads
+template<typename T>
+class BlockingQueue {
+public:
+    BlockingQueue(size_t capacity);
+
+    bool push(T item); // Blocks while the queue is full, returns false if the queue was closed
+    bool pop(T& item); // Blocks while the queue is empty, returns false if the queue is closed and empty
+    void close();
+
+private:
+    size_t capacity;
+    std::queue<T> items;
+    bool closed;
+
+    // Synchronization
+    std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+template<typename T>
+BlockingQueue<T>::BlockingQueue(size_t capacity): capacity(std::max<size_t>(capacity, 1)), closed(false){ }
+
+template<typename T>
+bool BlockingQueue<T>::push(T item){
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+        if(closed) return false;
+        items.push(std::move(item));
+    }
+    notEmpty.notify_one();
+    return true;
+}
+
+template<typename T>
+bool BlockingQueue<T>::pop(T& item){
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        notEmpty.wait(lock, [this]{ return closed || !items.empty(); });
+        if(items.empty()) return false;
+        item = std::move(items.front());
+        items.pop();
+    }
+    notFull.notify_one();
+    return true;
+}
+
+template<typename T>
+void BlockingQueue<T>::close(){
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        closed = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+}
+
+
+// Sequence lock, readers don't block writers and retry if data was modified during the read,
+// writers have to be serialized externally
+class SeqLock {
+public:
+    SeqLock(): seq(0) { }
+
+    inline size_t readBegin() const {
+        size_t s;
+        while ((s = seq.load(std::memory_order_acquire)) & 1) std::this_thread::yield();
+        return s;
+    }
+
+    inline bool readRetry(size_t s) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) != s;
+    }
+
+    inline void writeBegin() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void writeEnd() { seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    inline bool isWriting() const { return seq.load(std::memory_order_relaxed) & 1; }
+
+private:
+    std::atomic<size_t> seq;
+};
+
+// Ends the write section of the sequence lock on scope exit, also when the scope is left by an exception,
+// the section itself may be begun lazily within the scope, only once the data is actually modified
+class SeqLockWriteGuard {
+public:
+    explicit SeqLockWriteGuard(SeqLock& lock): lock(lock) { }
+    ~SeqLockWriteGuard() { if (lock.isWriting()) lock.writeEnd(); }
+
+    SeqLockWriteGuard(const SeqLockWriteGuard&) = delete;
+    SeqLockWriteGuard& operator=(const SeqLockWriteGuard&) = delete;
+
+private:
+    SeqLock& lock;
+};
+
+
+// Reader-writer lock with per-thread shards, shared locking touches only the shard of the calling thread,
+// exclusive locking has to lock all of them, so it should be rare
+class BigReaderLock {
+public:
+    void lock_shared() { shards[getShard()].mtx.lock_shared(); }
+    void unlock_shared() { shards[getShard()].mtx.unlock_shared(); }
+
+    void lock() { for (auto& s : shards) s.mtx.lock(); }
+    void unlock() { for (auto& s : shards) s.mtx.unlock(); }
+
+private:
+    static const size_t shardsCount = 64;
+
+    struct alignas(64) Shard {
+        std::shared_timed_mutex mtx;
+    };
+    Shard shards[shardsCount];
+
+    static size_t getShard() {
+        static std::atomic<size_t> nextShard(0);
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % shardsCount;
+        return shard;
+    }
+};
+
+
+// Counter with per-thread shards, increments touch only the shard of the calling thread,
+// so threads do not contend on one cache line, reading sums all the shards
+class ShardedCounter {
+public:
+    ShardedCounter() { clear(); }
+
+    void add(size_t value) { shards[getShard()].count.fetch_add(value, std::memory_order_relaxed); }
+    size_t sum() const {
+        size_t sum = 0;
+        for (auto& s : shards) sum += s.count.load(std::memory_order_relaxed);
+        return sum;
+    }
+    void clear() { for (auto& s : shards) s.count.store(0, std::memory_order_relaxed); }
+
+private:
+    static const size_t shardsCount = 64;
+
+    struct alignas(64) Shard {
+        std::atomic<size_t> count;
+    };
+    Shard shards[shardsCount];
+
+    static size_t getShard() {
+        static std::atomic<size_t> nextShard(0);
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % shardsCount;
+        return shard;
+    }
+};
+
+
+// Thread that calls the function every given number of seconds until it is stopped
+class PeriodicThread {
+public:
+    PeriodicThread(): stopped(true) { }
+    ~PeriodicThread() { stop(); }
+
+    void start(double interval, std::function<void()> func) {
+        stop();
+        stopped = false;
+        worker = std::thread([this, interval, func](){
+            std::unique_lock<std::mutex> lock(mtx);
+            while (!cv.wait_for(lock, std::chrono::duration<double>(interval), [this]{ return stopped; })) {
+                lock.unlock();
+                func();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopped = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+private:
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopped;
+};
@@ -48,6 +48,44 @@ template <typename T> inline Real dotVectors(T* vector1, T* vector2, const size_
     return val;
 }
 
+// Version for short dense vectors (e.g. embeddings), independent partial sums allow the compiler to vectorize it
+template <typename T> inline Real dotDenseVectors(const T* vector1, const T* vector2, const size_t size) {
+    Real val[8] = {0};
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+        for(size_t j = 0; j < 8; ++j) val[j] += vector1[i + j] * vector2[i + j];
+    for(; i < size; ++i) val[0] += vector1[i] * vector2[i];
+    return ((val[0] + val[1]) + (val[2] + val[3])) + ((val[4] + val[5]) + (val[6] + val[7]));
+}
+
+// Product of two dense matrices given by pointers to their rows, C = A * B^T, where C is M x N row-major matrix,
+// each row of B is multiplied with 4 rows of A at once, so it is loaded once per 4 rows,
+// and the products are accumulated in independent partial sums, so they can be vectorized
+template <typename T>
+inline void mulMatricesNT(const T* const* A, const T* const* B, T* C, const size_t M, const size_t N, const size_t K) {
+    const size_t rowsTile = 4;
+    const size_t lanes = 8;
+    size_t i = 0;
+    for(; i + rowsTile <= M; i += rowsTile) {
+        for(size_t j = 0; j < N; ++j) {
+            const T* b = B[j];
+            T c[rowsTile][lanes] = {{0}};
+            size_t k = 0;
+            for(; k + lanes <= K; k += lanes)
+                for(size_t r = 0; r < rowsTile; ++r)
+                    for(size_t l = 0; l < lanes; ++l) c[r][l] += A[i + r][k + l] * b[k + l];
+
+            for(size_t r = 0; r < rowsTile; ++r) {
+                T val = ((c[r][0] + c[r][1]) + (c[r][2] + c[r][3])) + ((c[r][4] + c[r][5]) + (c[r][6] + c[r][7]));
+                for(size_t kk = k; kk < K; ++kk) val += A[i + r][kk] * b[kk];
+                C[(i + r) * N + j] = val;
+            }
+        }
+    }
+    for(; i < M; ++i)
+        for(size_t j = 0; j < N; ++j) C[i * N + j] = dotDenseVectors(A[i], B[j], K);
+}
+
 template <typename T> inline Real dotVectors(T& vector1, T& vector2) {
     assert(vector1.size() == vector2.size());
     return dotVectors(vector1.data(), vector2.data(), vector2.size());
@@ -281,6 +319,7 @@ public:
         sorted = true;
     }
     explicit SparseVector(const AbstractVector& vec) {
+        s = vec.size();
         maxN0 = vec.nonZero() + 1;
         d = new IRVPair[maxN0 + 1];
         n0 = 0;
@@ -602,8 +641,8 @@ public:
     explicit Vector(const AbstractVector& vec): AbstractVector(vec) {
         s = vec.size();
         n0 = 0;
-        d = new Real[vec.size()];
-        vec.forEachIV([&](const int& i, Real& v) { d[i] = v; });
+        d = new Real[vec.size()]();
+        vec.forEachIV([&](const int& i, Real& v) { insertD(i, v); });
     }
     ~Vector() override{
         delete[] d;